@@ -0,0 +1,199 @@
+/*
+* bench.h
+*
+* Shared helpers for the MeMS benchmarks: timing, resident set size,
+* a small random number generator and hardware performance counters.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "mems.h"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+// Seconds on the monotonic clock
+double bench_now() {
+    return (double)monotonic_ns() / 1e9;
+}
+
+// Resident set size of the whole process, in bytes
+size_t bench_rss_bytes() {
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return 0;
+    }
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// xorshift64*, good enough to drive workloads and cheap enough not to skew them
+uint64_t bench_rand(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+// Uniform integer in [low, high]
+size_t bench_rand_range(uint64_t* state, size_t low, size_t high) {
+    return low + (size_t)(bench_rand(state) % (high - low + 1));
+}
+
+// Writes one byte of a MeMS allocation so that its page is really touched
+void bench_touch(void* v_ptr) {
+    char* p_addr = (char*)mems_get(v_ptr);
+    if (p_addr != NULL) {
+        *p_addr = 1;
+    }
+}
+
+/*
+* Hardware performance counters, collected per operation type with
+* perf_event_open. Each operation type owns a counter group that is only
+* enabled around its operations, so the totals divided by the number of
+* operations give the microarchitectural cost of one call. Only user space
+* is counted. The cost of enabling and disabling the group is measured once
+* and subtracted.
+*/
+#define BENCH_COUNTERS 5
+
+const char* bench_counter_names[BENCH_COUNTERS] = {"instructions", "cycles", "cache-misses", "dTLB-misses", "branch-misses"};
+
+struct bench_counters {
+    const char* op;
+    int fds[BENCH_COUNTERS];  // fds[0] leads the group, -1 when unavailable
+    uint64_t ops;
+};
+
+// Per-operation overhead of bench_counters_start/stop, from bench_counters_calibrate()
+double bench_counter_overhead[BENCH_COUNTERS];
+
+int perf_event_open_counter(uint32_t type, uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/*
+ * Opens a counter group for one operation type.
+ * @return 0 on success, -1 if the counters are unavailable (no PMU,
+ *         perf_event_paranoid too strict, ...).
+ */
+int bench_counters_open(struct bench_counters* counters, const char* op) {
+    static const uint64_t dtlb = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    uint32_t types[BENCH_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                      PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    uint64_t configs[BENCH_COUNTERS] = {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES,
+                                        PERF_COUNT_HW_CACHE_MISSES, dtlb, PERF_COUNT_HW_BRANCH_MISSES};
+    counters->op = op;
+    counters->ops = 0;
+    for (int i = 0; i < BENCH_COUNTERS; i++) {
+        counters->fds[i] = perf_event_open_counter(types[i], configs[i], i == 0 ? -1 : counters->fds[0]);
+        if (counters->fds[i] == -1) {
+            for (int j = 0; j < i; j++) {
+                close(counters->fds[j]);
+            }
+            counters->fds[0] = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void bench_counters_start(struct bench_counters* counters) {
+    if (counters->fds[0] != -1) {
+        ioctl(counters->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+void bench_counters_stop(struct bench_counters* counters) {
+    if (counters->fds[0] != -1) {
+        ioctl(counters->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+    counters->ops++;
+}
+
+// Reads the group totals into values; returns -1 if the counters are unavailable
+int bench_counters_read(struct bench_counters* counters, uint64_t values[BENCH_COUNTERS]) {
+    uint64_t buffer[1 + BENCH_COUNTERS];
+    if (counters->fds[0] == -1 || read(counters->fds[0], buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer)) {
+        return -1;
+    }
+    memcpy(values, buffer + 1, BENCH_COUNTERS * sizeof(uint64_t));
+    return 0;
+}
+
+void bench_counters_close(struct bench_counters* counters) {
+    if (counters->fds[0] != -1) {
+        for (int i = BENCH_COUNTERS - 1; i >= 0; i--) {
+            close(counters->fds[i]);
+        }
+        counters->fds[0] = -1;
+    }
+}
+
+/*
+ * Measures what an empty start/stop pair costs, including the two clock
+ * reads the benchmarks take inside it, so it can be subtracted from every
+ * operation.
+ */
+void bench_counters_calibrate() {
+    struct bench_counters empty;
+    uint64_t values[BENCH_COUNTERS];
+    if (bench_counters_open(&empty, "empty") != 0) {
+        return;
+    }
+    for (int i = 0; i < 10000; i++) {
+        bench_counters_start(&empty);
+        monotonic_ns();
+        monotonic_ns();
+        bench_counters_stop(&empty);
+    }
+    if (bench_counters_read(&empty, values) == 0) {
+        for (int i = 0; i < BENCH_COUNTERS; i++) {
+            bench_counter_overhead[i] = (double)values[i] / (double)empty.ops;
+        }
+    }
+    bench_counters_close(&empty);
+}
+
+// Prints the per-operation counter values of each operation type
+void bench_counters_report(struct bench_counters* counters, int count) {
+    printf("\n%-10s %10s", "op", "calls");
+    for (int i = 0; i < BENCH_COUNTERS; i++) {
+        printf(" %14s", bench_counter_names[i]);
+    }
+    printf(" %8s\n", "IPC");
+    for (int c = 0; c < count; c++) {
+        uint64_t values[BENCH_COUNTERS];
+        if (counters[c].ops == 0 || bench_counters_read(&counters[c], values) != 0) {
+            continue;
+        }
+        double per_op[BENCH_COUNTERS];
+        printf("%-10s %10lu", counters[c].op, (unsigned long)counters[c].ops);
+        for (int i = 0; i < BENCH_COUNTERS; i++) {
+            per_op[i] = (double)values[i] / (double)counters[c].ops - bench_counter_overhead[i];
+            printf(" %14.1f", per_op[i] > 0 ? per_op[i] : 0.0);
+        }
+        printf(" %8.2f\n", per_op[1] > 0 ? per_op[0] / per_op[1] : 0.0);
+    }
+}
+
+#endif // BENCH_H
@@ -0,0 +1,192 @@
+/*
+* bench_aging.c
+*
+* Long-running heap-aging benchmark. Objects with realistic size and
+* lifetime distributions are allocated and freed for many cycles, and the
+* allocation latency, pages used, unused space and main chain length are
+* sampled periodically. Policies are compared by running it under
+* different MEMS_CONF settings. With BENCH_PERF=1 the hardware counters
+* of mems_malloc, mems_free and mems_get are reported per call at the end.
+*
+* Usage: ./bench_aging [cycles] [sample_interval]
+*/
+
+#include "bench.h"
+
+struct object {
+    uint64_t death;  // Cycle at which the object is freed
+    void* v_ptr;
+};
+
+// Min-heap of live objects ordered by death cycle
+struct object* heap;
+size_t heap_len = 0;
+size_t heap_cap = 0;
+
+void heap_push(struct object object) {
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap != 0 ? heap_cap * 2 : 1024;
+        heap = (struct object*)realloc(heap, heap_cap * sizeof(struct object));
+    }
+    size_t i = heap_len++;
+    while (i > 0 && heap[(i - 1) / 2].death > object.death) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = object;
+}
+
+struct object heap_pop() {
+    struct object top = heap[0];
+    struct object last = heap[--heap_len];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= heap_len) {
+            break;
+        }
+        if (child + 1 < heap_len && heap[child + 1].death < heap[child].death) {
+            child++;
+        }
+        if (heap[child].death >= last.death) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/*
+ * Request sizes: mostly small objects, a quarter medium buffers and a few
+ * large ones, log-uniform within each band.
+ */
+size_t draw_size(uint64_t* rng) {
+    uint64_t band = bench_rand(rng) % 100;
+    double low = band < 70 ? 16 : band < 95 ? 256 : 8192;
+    double high = band < 70 ? 256 : band < 95 ? 8192 : 131072;
+    double unit = (double)(bench_rand(rng) >> 11) / (double)(1ull << 53);
+    return (size_t)(low * pow(high / low, unit));
+}
+
+/*
+ * Lifetimes in cycles: most objects die almost immediately, some live for
+ * a while and a few stay around for a large part of the run.
+ */
+uint64_t draw_lifetime(uint64_t* rng) {
+    uint64_t band = bench_rand(rng) % 100;
+    if (band < 80) {
+        return bench_rand_range(rng, 1, 100);
+    }
+    if (band < 98) {
+        return bench_rand_range(rng, 100, 10000);
+    }
+    return bench_rand_range(rng, 10000, 100000);
+}
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char const *argv[])
+{
+    uint64_t cycles = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+    uint64_t interval = argc > 2 ? strtoull(argv[2], NULL, 10) : 10000;
+    if (cycles == 0 || interval == 0) {
+        fprintf(stderr, "usage: %s [cycles] [sample_interval]\n", argv[0]);
+        return 1;
+    }
+
+    const char* conf = getenv("MEMS_CONF");
+    printf("MEMS_CONF=%s, %lu cycles\n", conf != NULL ? conf : "", (unsigned long)cycles);
+    printf("%10s %8s %10s %10s %10s %8s %12s %8s %9s\n", "cycle", "live", "malloc_ns", "p99_ns", "free_ns",
+           "pages", "unused_KiB", "chain", "segments");
+
+    struct bench_counters counters[3];
+    struct bench_counters* malloc_counters = &counters[0];
+    struct bench_counters* free_counters = &counters[1];
+    struct bench_counters* get_counters = &counters[2];
+    const char* perf = getenv("BENCH_PERF");
+    int use_perf = perf != NULL && atoi(perf) != 0;
+    if (use_perf) {
+        if (bench_counters_open(malloc_counters, "malloc") != 0 || bench_counters_open(free_counters, "free") != 0 ||
+            bench_counters_open(get_counters, "get") != 0) {
+            perror("perf_event_open");
+            fprintf(stderr, "hardware counters unavailable, continuing without them\n");
+            for (int i = 0; i < 3; i++) {
+                bench_counters_close(&counters[i]);
+            }
+            use_perf = 0;
+        } else {
+            bench_counters_calibrate();
+        }
+    }
+
+    mems_init();
+    uint64_t rng = 0x853C49E6748FEA9Bull;
+    uint64_t* malloc_ns = (uint64_t*)malloc(interval * sizeof(uint64_t));
+    uint64_t free_ns = 0;
+    uint64_t frees = 0;
+    for (uint64_t cycle = 1; cycle <= cycles; cycle++) {
+        while (heap_len != 0 && heap[0].death <= cycle) {
+            struct object dead = heap_pop();
+            bench_counters_start(free_counters);
+            uint64_t start = monotonic_ns();
+            mems_free(dead.v_ptr);
+            free_ns += monotonic_ns() - start;
+            bench_counters_stop(free_counters);
+            frees++;
+        }
+
+        size_t size = draw_size(&rng);
+        bench_counters_start(malloc_counters);
+        uint64_t start = monotonic_ns();
+        void* v_ptr = mems_malloc(size);
+        malloc_ns[(cycle - 1) % interval] = monotonic_ns() - start;
+        bench_counters_stop(malloc_counters);
+        if (v_ptr == NULL) {
+            fprintf(stderr, "mems_malloc(%zu) failed at cycle %lu\n", size, (unsigned long)cycle);
+            return 1;
+        }
+        bench_counters_start(get_counters);
+        monotonic_ns();
+        char* p_addr = (char*)mems_get(v_ptr);
+        monotonic_ns();
+        bench_counters_stop(get_counters);
+        *p_addr = 1;
+        struct object object = {cycle + draw_lifetime(&rng), v_ptr};
+        heap_push(object);
+
+        if (cycle % interval == 0) {
+            uint64_t total = 0;
+            for (uint64_t i = 0; i < interval; i++) {
+                total += malloc_ns[i];
+            }
+            qsort(malloc_ns, interval, sizeof(uint64_t), compare_u64);
+            struct mems_stats stats;
+            mems_get_stats(&stats);
+            printf("%10lu %8zu %10.0f %10lu %10.0f %8zu %12.1f %8zu %9zu\n", (unsigned long)cycle, heap_len,
+                   (double)total / interval, (unsigned long)malloc_ns[interval * 99 / 100],
+                   frees != 0 ? (double)free_ns / frees : 0.0, stats.pages, stats.unused_bytes / 1024.0,
+                   stats.main_chain_len, stats.segments);
+            fflush(stdout);
+            free_ns = 0;
+            frees = 0;
+        }
+    }
+
+    if (use_perf) {
+        bench_counters_report(counters, 3);
+        for (int i = 0; i < 3; i++) {
+            bench_counters_close(&counters[i]);
+        }
+    }
+
+    free(malloc_ns);
+    free(heap);
+    mems_finish();
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+* bench_color.c
+*
+* Slab coloring benchmark. One object of every thread cache slab is kept
+* hot and read in a loop. Page-sized objects put every object of a slab at
+* the same page offset, so without coloring all hot lines compete for the
+* same L1 cache set. The loop is timed with coloring disabled
+* (opt.slab_colors = 1) and with increasing numbers of colors; L1 data
+* cache read misses are reported as well when perf_event_open is usable.
+*
+* Usage: ./bench_color [slabs] [rounds]
+*/
+
+#include "bench.h"
+
+#define OBJECT_SIZE 4096
+#define OBJECTS_PER_SLAB (TCACHE_SLAB_SIZE / OBJECT_SIZE)
+
+struct color_result {
+    double ns_per_read;
+    double misses_per_read;  // Negative when the counter is unavailable
+};
+
+struct color_result run(size_t colors, size_t slabs, size_t rounds) {
+    struct color_result result = {0.0, -1.0};
+    mems_init();
+    mems_ctl("opt.slab_colors", NULL, NULL, &colors, sizeof(colors));
+
+    size_t count = slabs * OBJECTS_PER_SLAB;
+    char** objects = (char**)malloc(count * sizeof(char*));
+    char** hot = (char**)malloc(slabs * sizeof(char*));
+    for (size_t i = 0; i < count; i++) {
+        objects[i] = (char*)mems_tcache_alloc(OBJECT_SIZE);
+        memset(objects[i], 1, 64);
+    }
+    // Consecutive allocations come from the same slab, keep one per slab
+    for (size_t i = 0; i < slabs; i++) {
+        hot[i] = objects[i * OBJECTS_PER_SLAB];
+    }
+
+    uint64_t dl1 = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    int fd = perf_event_open_counter(PERF_TYPE_HW_CACHE, dl1, -1);
+    volatile uint64_t sink = 0;
+    for (size_t i = 0; i < slabs; i++) {
+        sink += *(volatile uint64_t*)(hot[i] + 8);
+    }
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = bench_now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < slabs; i++) {
+            sink += *(volatile uint64_t*)(hot[i] + 8);
+        }
+    }
+    double elapsed = bench_now() - start;
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t values[2];
+        if (read(fd, values, sizeof(values)) == (ssize_t)sizeof(values)) {
+            result.misses_per_read = (double)values[1] / (double)(rounds * slabs);
+        }
+        close(fd);
+    }
+    result.ns_per_read = elapsed * 1e9 / (double)(rounds * slabs);
+
+    for (size_t i = 0; i < count; i++) {
+        mems_tcache_free(objects[i], OBJECT_SIZE);
+    }
+    free(hot);
+    free(objects);
+    mems_finish();
+    return result;
+}
+
+int main(int argc, char const *argv[])
+{
+    size_t slabs = argc > 1 ? strtoull(argv[1], NULL, 10) : 64;
+    size_t rounds = argc > 2 ? strtoull(argv[2], NULL, 10) : 200000;
+    if (slabs == 0 || rounds == 0) {
+        fprintf(stderr, "usage: %s [slabs] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%zu hot objects, one per %d-byte object slab, %zu rounds\n", slabs, OBJECT_SIZE, rounds);
+    printf("%8s %12s %16s\n", "colors", "ns/read", "L1D misses/read");
+    size_t colors[] = {1, 2, 4, 8, 16, 64};
+    for (size_t i = 0; i < sizeof(colors) / sizeof(colors[0]); i++) {
+        struct color_result result = run(colors[i], slabs, rounds);
+        if (result.misses_per_read < 0) {
+            printf("%8zu %12.2f %16s\n", colors[i], result.ns_per_read, "n/a");
+        } else {
+            printf("%8zu %12.2f %16.3f\n", colors[i], result.ns_per_read, result.misses_per_read);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
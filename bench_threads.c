@@ -0,0 +1,284 @@
+/*
+* bench_threads.c
+*
+* Multi-threaded allocator workloads for MeMS. Every workload is run with
+* 1, 2, 4, ... up to the requested number of threads, reporting throughput,
+* scaling relative to one thread and the resident set size at each point.
+*
+* Usage: ./bench_threads [max_threads] [ops_per_thread]
+*/
+
+#include "bench.h"
+#include <sched.h>
+
+// Objects each thread keeps live in the churn workloads
+#define LIVE_OBJECTS 256
+// Objects handed over at once in the xmalloc workload
+#define BATCH 64
+// Capacity of the producer/consumer rings, a power of two
+#define RING_SIZE 1024
+
+struct bench_config {
+    int threads;
+    size_t ops;
+};
+
+struct bench_thread {
+    int id;
+    struct bench_config* config;
+    pthread_barrier_t* barrier;
+    void** slots;       // Larson: the live objects this thread currently owns
+    uint64_t rng;
+};
+
+/*
+ * threadtest: each thread repeatedly allocates a batch of objects and then
+ * frees all of them.
+ */
+void* threadtest_worker(void* arg) {
+    struct bench_thread* thread = (struct bench_thread*)arg;
+    void* objects[LIVE_OBJECTS];
+    size_t rounds = thread->config->ops / (2 * LIVE_OBJECTS);
+    for (size_t round = 0; round < rounds; round++) {
+        for (int i = 0; i < LIVE_OBJECTS; i++) {
+            objects[i] = mems_malloc(64);
+            bench_touch(objects[i]);
+        }
+        for (int i = 0; i < LIVE_OBJECTS; i++) {
+            mems_free(objects[i]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * threadtest over the thread caches: the same pattern served by
+ * mems_tcache_alloc() instead of the shared heap.
+ */
+void* tcache_worker(void* arg) {
+    struct bench_thread* thread = (struct bench_thread*)arg;
+    void* objects[LIVE_OBJECTS];
+    size_t rounds = thread->config->ops / (2 * LIVE_OBJECTS);
+    for (size_t round = 0; round < rounds; round++) {
+        for (int i = 0; i < LIVE_OBJECTS; i++) {
+            objects[i] = mems_tcache_alloc(64);
+            *(char*)objects[i] = 1;
+        }
+        for (int i = 0; i < LIVE_OBJECTS; i++) {
+            mems_tcache_free(objects[i], 64);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Larson-style server churn: each thread replaces random objects in its
+ * slot array with new ones of random size. Between rounds the slot arrays
+ * rotate to the next thread, so objects are freed by a different thread
+ * than the one that allocated them, as when a server hands connections
+ * between workers.
+ */
+#define LARSON_ROUNDS 4
+
+struct bench_thread* larson_threads;
+
+void* larson_worker(void* arg) {
+    struct bench_thread* thread = (struct bench_thread*)arg;
+    int threads = thread->config->threads;
+    size_t ops_per_round = thread->config->ops / (2 * LARSON_ROUNDS);
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        void** slots = larson_threads[(thread->id + round) % threads].slots;
+        for (size_t i = 0; i < ops_per_round; i++) {
+            size_t slot = bench_rand(&thread->rng) % LIVE_OBJECTS;
+            mems_free(slots[slot]);
+            slots[slot] = mems_malloc(bench_rand_range(&thread->rng, 16, 512));
+            bench_touch(slots[slot]);
+        }
+        pthread_barrier_wait(thread->barrier);
+    }
+    return NULL;
+}
+
+/*
+ * Producer/consumer: threads are paired, the producer allocates objects
+ * and passes them through a single-producer single-consumer ring to the
+ * consumer, which frees them. A lone thread plays both roles.
+ */
+struct ring {
+    void* slots[RING_SIZE];
+    size_t head; // Next slot to read, advanced by the consumer
+    size_t tail; // Next slot to write, advanced by the producer
+};
+
+struct ring* rings;
+
+void* prodcons_worker(void* arg) {
+    struct bench_thread* thread = (struct bench_thread*)arg;
+    size_t objects = thread->config->ops / 2;
+    if (thread->config->threads == 1) {
+        for (size_t i = 0; i < objects; i++) {
+            void* object = mems_malloc(bench_rand_range(&thread->rng, 16, 256));
+            bench_touch(object);
+            mems_free(object);
+        }
+        return NULL;
+    }
+
+    struct ring* ring = &rings[thread->id / 2];
+    // Both sides of a pair move the same number of objects
+    objects = thread->config->ops;
+    if (thread->id % 2 == 0) {
+        for (size_t i = 0; i < objects; i++) {
+            void* object = mems_malloc(bench_rand_range(&thread->rng, 16, 256));
+            bench_touch(object);
+            while (__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+                sched_yield();
+            }
+            ring->slots[ring->tail % RING_SIZE] = object;
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+        }
+    } else {
+        for (size_t i = 0; i < objects; i++) {
+            while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&ring->head, __ATOMIC_RELAXED)) {
+                sched_yield();
+            }
+            mems_free(ring->slots[ring->head % RING_SIZE]);
+            __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * xmalloc-style: every thread allocates batches of objects and publishes
+ * them on a shared stack, then frees whichever batch it pops next, which
+ * was usually allocated by another thread.
+ */
+struct batch {
+    void* objects[BATCH];
+    struct batch* next;
+};
+
+struct batch* shared_batches;
+pthread_mutex_t shared_batches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void* xmalloc_worker(void* arg) {
+    struct bench_thread* thread = (struct bench_thread*)arg;
+    size_t rounds = thread->config->ops / (2 * BATCH);
+    struct batch* own = (struct batch*)calloc(1, sizeof(struct batch));
+    for (size_t round = 0; round < rounds; round++) {
+        for (int i = 0; i < BATCH; i++) {
+            own->objects[i] = mems_malloc(bench_rand_range(&thread->rng, 16, 1024));
+            bench_touch(own->objects[i]);
+        }
+        // Swap our batch for one published by another thread, if there is one
+        pthread_mutex_lock(&shared_batches_lock);
+        struct batch* taken = shared_batches;
+        if (taken != NULL) {
+            shared_batches = taken->next;
+            own->next = shared_batches;
+            shared_batches = own;
+        } else {
+            taken = own;
+        }
+        pthread_mutex_unlock(&shared_batches_lock);
+        for (int i = 0; i < BATCH; i++) {
+            mems_free(taken->objects[i]);
+        }
+        own = taken;
+    }
+    free(own);
+    return NULL;
+}
+
+struct workload {
+    const char* name;
+    void* (*worker)(void*);
+};
+
+struct workload workloads[] = {
+    {"threadtest", threadtest_worker},
+    {"threadtest-tcache", tcache_worker},
+    {"larson", larson_worker},
+    {"prodcons", prodcons_worker},
+    {"xmalloc", xmalloc_worker},
+};
+
+/*
+ * Runs one workload with the given number of threads on a fresh heap.
+ * @return The number of allocator operations per second.
+ */
+double run_workload(struct workload* workload, struct bench_config* config, size_t* rss) {
+    pthread_t threads[config->threads];
+    struct bench_thread state[config->threads];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, config->threads);
+
+    mems_init();
+    larson_threads = state;
+    rings = (struct ring*)calloc((config->threads + 1) / 2, sizeof(struct ring));
+    shared_batches = NULL;
+    for (int i = 0; i < config->threads; i++) {
+        state[i].id = i;
+        state[i].config = config;
+        state[i].barrier = &barrier;
+        state[i].rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        state[i].slots = NULL;
+        if (workload->worker == larson_worker) {
+            state[i].slots = (void**)malloc(LIVE_OBJECTS * sizeof(void*));
+            for (int slot = 0; slot < LIVE_OBJECTS; slot++) {
+                state[i].slots[slot] = mems_malloc(bench_rand_range(&state[i].rng, 16, 512));
+            }
+        }
+    }
+
+    double start = bench_now();
+    for (int i = 0; i < config->threads; i++) {
+        pthread_create(&threads[i], NULL, workload->worker, &state[i]);
+    }
+    for (int i = 0; i < config->threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = bench_now() - start;
+    *rss = bench_rss_bytes();
+
+    while (shared_batches != NULL) {
+        struct batch* batch = shared_batches;
+        shared_batches = batch->next;
+        free(batch);
+    }
+    for (int i = 0; i < config->threads; i++) {
+        free(state[i].slots);
+    }
+    free(rings);
+    pthread_barrier_destroy(&barrier);
+    mems_finish();
+    return (double)(config->ops * config->threads) / elapsed;
+}
+
+int main(int argc, char const *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    size_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 20000;
+    if (max_threads < 1 || ops < 2 * LIVE_OBJECTS) {
+        fprintf(stderr, "usage: %s [max_threads >= 1] [ops_per_thread >= %d]\n", argv[0], 2 * LIVE_OBJECTS);
+        return 1;
+    }
+
+    printf("%-18s %8s %14s %9s %10s\n", "workload", "threads", "ops/sec", "scaling", "RSS (MiB)");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        double base = 0;
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            struct bench_config config = {threads, ops};
+            size_t rss = 0;
+            double throughput = run_workload(&workloads[w], &config, &rss);
+            if (threads == 1) {
+                base = throughput;
+            }
+            printf("%-18s %8d %14.0f %8.2fx %10.1f\n", workloads[w].name, threads, throughput,
+                   throughput / base, (double)rss / (1024.0 * 1024.0));
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -7,13 +7,33 @@
 * through a segmented free-list approach.
 */
 
+#ifndef MEMS_H
+#define MEMS_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For mremap
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*
 * The page size for memory allocation. While this can differ between systems,
 * it is defined as a macro for consistent behavior and evaluation.
@@ -23,10 +43,26 @@
 // Constants to identify the type of a memory segment
 #define HOLE 0
 #define PROCESS 1
+#define PAD 2 // Tail padding owned by the PROCESS segment before it, see mems_malloc_isolated()
+
+// main_node flags
+#define MAIN_LOCKED 1 // mlock'ed buffer pool memory, never reset, freed or purged
+
+// sub_node flags
+#define SUB_PURGED 1 // Hole whose whole pages were returned to the OS
 
 // The starting virtual address for the MeMS address space
 #define START_VIRTUAL_ADDRESS 1000
 
+/*
+* Tagged virtual addresses. With opt.tagged_vaddr set, the MeMS virtual
+* address of every byte is ((slot + 1) << TAG_SHIFT) | offset, where slot
+* indexes main_slots and offset is the byte's position in its main_node.
+* The owning main_node is then found with a table lookup.
+*/
+#define TAG_SHIFT 32
+#define TAG_OFFSET_MASK ((1ull << TAG_SHIFT) - 1)
+
 // Represents a contiguous block of memory requested from the OS
 struct main_node {
     int num_of_pages;
@@ -36,19 +72,22 @@ struct main_node {
     struct main_node* next;
     struct main_node* prev;
     struct sub_node* sub_head; // Head of the list of segments within this block
-    int padding[2]; // Ensures the struct size is 64 bytes for alignment
+    int flags;
+    unsigned int checkpoint_hash; // Descriptor hash at the last checkpoint, 0 if never written
 };
 
 // Represents a segment (process or hole) within a main_node block
 struct sub_node {
-    int type; // HOLE or PROCESS
+    int type; // HOLE, PROCESS or PAD
     int size;
     void* p_addr;
     void* v_addr_start;
     void* v_addr_end;
     struct sub_node* next;
     struct sub_node* prev;
-    int padding[4]; // Ensures the struct size is 64 bytes for alignment
+    int flags;
+    int site;       // Lifetime profiler call site index of a sampled segment
+    uint64_t birth; // Allocation time of a sampled segment in ns, 0 if not sampled
 };
 
 // Global pointers for managing the linked lists of nodes
@@ -57,10 +96,129 @@ void* sub_node_tracker;
 void* current_main_node_map;
 void* current_sub_node_map;
 
+/*
+* Serializes access to the heap. It is recursive so that public functions
+* can call each other while holding it.
+*/
+pthread_mutex_t mems_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
 // Global head for the main chain of allocated memory blocks
 struct main_node* head_main = NULL;
 void* start_virtual_address = NULL;
 
+/*
+* Runtime tunables. They default to the historical compile-time behaviour and
+* can be changed through mems_ctl() or the MEMS_CONF environment variable.
+*/
+double mems_opt_growth_factor = 1.0;                   // New mappings cover size * growth_factor bytes
+size_t mems_opt_split_threshold = sizeof(struct sub_node); // Minimum leftover before a hole is split
+size_t mems_opt_purge_decay = 0;                       // Purge holes every N frees (0 disables)
+
+/*
+* Adaptive mode. When enabled, MeMS observes its own workload and retunes the
+* parameters above every mems_opt_adaptive_interval operations, staying
+* within the configured bounds.
+*/
+size_t mems_opt_adaptive = 0;
+size_t mems_opt_adaptive_interval = 4096;
+double mems_opt_adaptive_growth_max = 16.0;
+size_t mems_opt_adaptive_split_max = 1024;
+size_t mems_opt_adaptive_decay_min = 16;
+size_t mems_opt_adaptive_decay_max = 4096;
+
+size_t mems_opt_mremap_threshold = 65536;             // Segments this large may grow by mremap
+size_t mems_opt_tcache_max = 64;                      // Objects a thread cache keeps per size class
+size_t mems_opt_tcache_steal = 1;                      // Spill to per-thread deques that other thread caches steal from
+size_t mems_opt_slab_colors = 8;                       // Cache line offsets thread cache slabs rotate through
+size_t mems_opt_nt_threshold = 1 << 20;              // Copies and fills this large bypass the cache
+size_t mems_opt_threads = 1;                           // Worker threads for whole-heap traversals
+size_t mems_opt_tagged_vaddr = 0;                      // Encode the main_node slot in virtual addresses
+size_t mems_opt_isolation_line = 64;                   // Cache line size mems_malloc_isolated() pads to
+size_t mems_opt_lifetime_sample = 0;                   // Profile the lifetime of 1 in N allocations (0 disables)
+size_t mems_opt_flight_events = 256;                   // Events kept per thread by the flight recorder (0 disables)
+size_t mems_opt_flight_signal = 0;                     // Signal that dumps the flight recorder (0 installs none)
+
+/*
+* Memory pressure monitor. When enabled, a background thread samples
+* /proc/pressure/memory and the cgroup v2 memory.current / memory.high
+* files every mems_opt_pressure_interval_ms and reclaims memory with
+* increasingly aggressive steps while pressure lasts.
+*/
+size_t mems_opt_pressure = 0;
+size_t mems_opt_pressure_interval_ms = 1000;
+double mems_opt_pressure_psi = 10.0;   // "some avg10" percentage at which reclaiming starts
+double mems_opt_pressure_cgroup = 0.9; // memory.current / memory.high ratio at which reclaiming starts
+
+/*
+* Soft resident set size target. Every mems_opt_rss_interval frees, MeMS
+* measures how many of its pages are resident and, while above the target,
+* purges at most mems_opt_rss_step bytes of holes per step until it is
+* comfortably below it again.
+*/
+size_t mems_opt_rss_target = 0;        // Resident bytes to stay near (0 disables)
+size_t mems_opt_rss_interval = 1024;   // Frees between two pacing steps
+size_t mems_opt_rss_step = 1 << 20;    // Bytes purged at most per pacing step
+
+size_t frees_since_purge = 0;
+size_t frees_since_rss_step = 0;
+
+/*
+* Incremented whenever previously valid translations may have changed, i.e.
+* when a segment is freed or memory is reset or unmapped. Callers caching
+* results of mems_get() compare against it to know when to translate again.
+*/
+uint64_t mems_epoch = 0;
+
+// Bumped when the heap is reset or unmapped, which invalidates every thread cache
+uint64_t tcache_generation = 0;
+size_t tcache_slabs = 0; // Slabs carved for the thread caches
+size_t tcache_steals = 0; // Batches one thread cache took from another's deque
+
+size_t pressure_level = 0;       // Last level seen by the pressure monitor, 0 to 3
+size_t pressure_escalations = 0; // Times the level went up
+size_t pressure_released = 0;    // Bytes handed back to the OS under pressure
+
+size_t rss_resident = 0;         // Resident MeMS bytes, measured or estimated at the last pacing step
+size_t rss_steps = 0;            // Pacing steps that purged memory
+size_t rss_purged = 0;           // Bytes purged by pacing steps
+
+size_t lifetime_sampled = 0;     // Allocations stamped by the lifetime profiler
+size_t lifetime_freed = 0;       // Sampled allocations whose lifetime was recorded
+
+// Number of power-of-two buckets in the allocation size histogram
+#define SIZE_BUCKETS 32
+
+size_t malloc_size_histogram[SIZE_BUCKETS]; // Requests per size bucket since mems_init
+size_t mapped_pages = 0;                     // Pages currently mapped for the heap
+size_t peak_pages = 0;                       // Highest value of mapped_pages
+
+// Workload observations gathered between two tuning passes
+struct adaptive_window {
+    size_t ops;
+    size_t mallocs;
+    size_t mappings;   // mems_malloc calls that had to mmap a new main_node
+    size_t frees;
+    uint64_t free_ns;  // Total time spent inside mems_free
+    size_t size_histogram[SIZE_BUCKETS];
+};
+
+// A single parameter change made by the adaptive tuner
+struct tune_decision {
+    size_t pass;
+    const char* param;
+    double old_value;
+    double new_value;
+    const char* reason;
+};
+
+#define TUNE_LOG_SIZE 16
+
+struct adaptive_window adaptive_window;
+uint64_t adaptive_prev_free_ns = 0; // Mean free latency of the previous window
+size_t adaptive_passes = 0;
+size_t tune_decisions_total = 0;
+struct tune_decision tune_log[TUNE_LOG_SIZE];
+
 void init_free_list() {
     main_node_tracker = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -76,7 +234,20 @@ void init_free_list() {
     current_sub_node_map = sub_node_tracker;
 }
 
+// main_nodes by slot when opt.tagged_vaddr is set; released nodes leave a NULL
+struct main_node** main_slots = NULL;
+size_t main_slots_len = 0;
+size_t main_slots_cap = 0;
+
+// Main nodes released under memory pressure, linked through their next pointer
+struct main_node* free_main_nodes = NULL;
+
 struct main_node* add_main_node() {
+    if (free_main_nodes != NULL) {
+        struct main_node* recycled = free_main_nodes;
+        free_main_nodes = recycled->next;
+        return recycled;
+    }
     // if no more nodes can be added to the current mmap page
     if (main_node_tracker + sizeof(struct main_node) > current_main_node_map + PAGE_SIZE) {
         current_main_node_map = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -93,253 +264,3911 @@ struct main_node* add_main_node() {
     }
 }
 
+/*
+ * Finds the main_node whose virtual range contains v_ptr. Tagged addresses
+ * are decoded to their slot; otherwise the main chain is searched.
+ * @return The main_node, or NULL if no mapping contains v_ptr.
+ */
+struct main_node* find_main_node(const void* v_ptr) {
+    if (mems_opt_tagged_vaddr) {
+        size_t slot = ((uintptr_t)v_ptr >> TAG_SHIFT) - 1;
+        if (slot >= main_slots_len || main_slots[slot] == NULL || v_ptr > main_slots[slot]->v_addr_end) {
+            return NULL;
+        }
+        return main_slots[slot];
+    }
+    struct main_node* current_main_node = head_main->next;
+    while (current_main_node != head_main) {
+        if (v_ptr >= current_main_node->v_addr_start && v_ptr <= current_main_node->v_addr_end) {
+            return current_main_node;
+        }
+        current_main_node = current_main_node->next;
+    }
+    return NULL;
+}
+
+// Sub nodes released by merges and resets, linked through their next pointer
+struct sub_node* free_sub_nodes = NULL;
+
 struct sub_node* add_sub_node() {
-    if (sub_node_tracker + sizeof(struct sub_node) > current_sub_node_map + PAGE_SIZE) {
+    struct sub_node* new_sub_node;
+    if (free_sub_nodes != NULL) {
+        new_sub_node = free_sub_nodes;
+        free_sub_nodes = new_sub_node->next;
+    } else if (sub_node_tracker + sizeof(struct sub_node) > current_sub_node_map + PAGE_SIZE) {
         current_sub_node_map = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
         if (current_sub_node_map == MAP_FAILED) {
             perror("mmap failed");
         }
         sub_node_tracker = current_sub_node_map + sizeof(struct sub_node);
-        return (struct sub_node*)current_sub_node_map;
+        new_sub_node = (struct sub_node*)current_sub_node_map;
     } else {
-        struct sub_node* new_main_node = (struct sub_node*)sub_node_tracker;
+        new_sub_node = (struct sub_node*)sub_node_tracker;
         sub_node_tracker = sub_node_tracker + sizeof(struct sub_node);
-        return new_main_node;
     }
+    new_sub_node->flags = 0;
+    new_sub_node->birth = 0;
+    return new_sub_node;
 }
 
-/*
- * Initializes the MeMS system, setting up the free list and
- * other necessary global variables.
- */
-void mems_init() {
-    init_free_list();
-    head_main = add_main_node();
-    head_main->num_of_pages = 0;
-    head_main->next = head_main;
-    head_main->prev = head_main;
-    head_main->sub_head = NULL;
-    start_virtual_address = (void *)START_VIRTUAL_ADDRESS;
-    head_main->v_addr_start = start_virtual_address;
-    head_main->v_addr_end = start_virtual_address-1;
+void release_sub_node(struct sub_node* node) {
+    node->next = free_sub_nodes;
+    free_sub_nodes = node;
 }
 
 /*
- * Deallocates all memory managed by the MeMS system.
- * It unmaps all memory regions previously obtained from the OS via mmap.
+ * Returns the whole pages inside a hole to the OS with MADV_DONTNEED and
+ * marks the hole as purged. The mapping stays in place and the pages are
+ * faulted back in on the next write.
+ * @return The number of bytes released.
  */
-void mems_finish() {
-    struct main_node* current_main_node = head_main->next;
-    while (current_main_node != head_main) {
-        struct main_node* temp = current_main_node;
-        current_main_node = current_main_node->next;
-        if (munmap(temp->p_addr, temp->num_of_pages * PAGE_SIZE) == -1) {
-            perror("munmap failed on mems_finish");
-        }
+size_t purge_hole(struct sub_node* hole) {
+    uintptr_t start = ((uintptr_t)hole->p_addr + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)hole->p_addr + hole->size) & ~(uintptr_t)(PAGE_SIZE - 1);
+    hole->flags |= SUB_PURGED;
+    if (end > start && madvise((void*)start, end - start, MADV_DONTNEED) == 0) {
+        return end - start;
     }
-    head_main->next = head_main;
-    // Note: The pages used for tracking nodes are not unmapped here
-    // in this implementation, as they are managed by the OS heap.
-    // A more robust implementation might track and free these as well.
+    return 0;
 }
 
 /*
- * Allocates a memory segment of a specified size.
- * It attempts to find a suitable hole in the free list. If none is found,
- * it requests more memory from the OS using mmap.
- * @param size The number of bytes to allocate.
- * @return A MeMS virtual address to the start of the allocated segment, or NULL on failure.
+ * Purges every hole that has not been purged since it was last freed.
+ * @return The number of bytes released.
  */
-void* mems_malloc(size_t size) {
-    if (size == 0) {
-        return NULL;
-    }
-
+size_t purge_holes() {
+    size_t purged = 0;
     struct main_node* current_main_node = head_main->next;
-    // Search for a suitable hole in existing pages
     while (current_main_node != head_main) {
         struct sub_node* current_sub_node = current_main_node->sub_head;
         while (current_sub_node != NULL) {
-            if (current_sub_node->type == HOLE && current_sub_node->size >= size) {
-                if (current_sub_node->size > size + sizeof(struct sub_node)) {
-                    // Split the hole
-                    struct sub_node* new_hole = add_sub_node();
-                    new_hole->type = HOLE;
-                    new_hole->size = current_sub_node->size - (int)size;
-                    new_hole->p_addr = (void*)(current_sub_node->p_addr + size);
-                    new_hole->v_addr_start = (void*)(current_sub_node->v_addr_start + size);
-                    new_hole->v_addr_end = current_sub_node->v_addr_end;
-                    new_hole->next = current_sub_node->next;
-                    new_hole->prev = current_sub_node;
-
-                    if (current_sub_node->next != NULL) {
-                        current_sub_node->next->prev = new_hole;
-                    }
-                    current_sub_node->next = new_hole;
-                    current_sub_node->size = (int)size;
-                    current_sub_node->v_addr_end = (void*)(current_sub_node->v_addr_start + size - 1); 
-                }
-                current_sub_node->type = PROCESS;
-                return current_sub_node->v_addr_start;
+            if (current_sub_node->type == HOLE && !(current_sub_node->flags & SUB_PURGED)) {
+                purged += purge_hole(current_sub_node);
             }
             current_sub_node = current_sub_node->next;
         }
         current_main_node = current_main_node->next;
     }
+    return purged;
+}
 
-    // No suitable hole found, allocate new page(s)
-    current_main_node = current_main_node->prev;
-    int num_of_pages = ceil((double)size / (double)PAGE_SIZE);
-    void* p_addr = mmap(NULL, num_of_pages * PAGE_SIZE, PROT_READ | PROT_WRITE,
-                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-
-    if (p_addr == MAP_FAILED) {
-        perror("mmap failed on mems_malloc");
-        return NULL;
-    }
-
-    struct main_node* new_main_node = add_main_node();
-    new_main_node->p_addr = p_addr;
-    new_main_node->num_of_pages = num_of_pages;
-    new_main_node->v_addr_start = current_main_node->v_addr_end + 1;
-    new_main_node->v_addr_end = new_main_node->v_addr_start + (num_of_pages * PAGE_SIZE) - 1;
-    new_main_node->next = head_main;
-    new_main_node->prev = current_main_node;
-    current_main_node->next = new_main_node;
-    head_main->prev = new_main_node;
+// Upper bound for mems_opt_threads
+#define MAX_TRAVERSAL_THREADS 64
+// Main chains shorter than this per worker are traversed on the calling thread
+#define PARALLEL_MIN_NODES 256
 
-    struct sub_node* new_sub_node = add_sub_node();
-    new_sub_node->type = PROCESS;
-    new_sub_node->size = (int)size;
-    new_sub_node->p_addr = p_addr;
-    new_sub_node->v_addr_start = new_main_node->v_addr_start;
-    new_sub_node->v_addr_end = (void*)(new_sub_node->v_addr_start + size - 1);
-    new_sub_node->next = NULL;
-    new_sub_node->prev = NULL;
+// A contiguous run of the main chain handed to one traversal worker
+struct traversal_task {
+    struct main_node* first;
+    size_t count;
+    void (*visit)(struct main_node* first, size_t count, void* result);
+    void* result;
+};
 
-    // Create a new hole for the remaining space
-    if (size < num_of_pages * PAGE_SIZE) {
-        struct sub_node* new_hole = add_sub_node();
-        new_hole->type = HOLE;
-        new_hole->size = num_of_pages * PAGE_SIZE - (int)size;
-        new_hole->p_addr = (void*)(p_addr + size);
-        new_hole->v_addr_start = (void*)(new_sub_node->v_addr_start + size);
-        new_hole->v_addr_end = new_main_node->v_addr_end;
-        new_hole->next = NULL;
-        new_hole->prev = new_sub_node;
-        new_sub_node->next = new_hole;
-    }
-    
-    new_main_node->sub_head = new_sub_node;
-    return new_sub_node->v_addr_start;
+void* traversal_worker(void* arg) {
+    struct traversal_task* task = (struct traversal_task*)arg;
+    task->visit(task->first, task->count, task->result);
+    return NULL;
 }
 
 /*
- * Prints statistics about the current state of the MeMS system,
- * including page usage, fragmentation, and memory layout.
+ * Runs visit over the whole main chain, split into contiguous runs of
+ * main_nodes that are processed by up to mems_opt_threads threads. Each run
+ * writes into its own result slot so callers can reduce them afterwards
+ * without locking. visit must not modify the main chain links.
+ * @param visit Called once per run with its first node and length.
+ * @param results Array of MAX_TRAVERSAL_THREADS result slots.
+ * @param result_size Size of one result slot in bytes.
+ * @return The number of result slots that were filled.
  */
-void mems_print_stats() {
-    if (head_main->next == head_main) {
-        printf("MeMS Status: No pages allocated.\n");
-        return;
+size_t parallel_traverse(void (*visit)(struct main_node*, size_t, void*), void* results, size_t result_size) {
+    size_t count = 0;
+    for (struct main_node* node = head_main->next; node != head_main; node = node->next) {
+        count++;
     }
 
-    struct main_node* current_main_node = head_main->next;
-    int total_pages = 0;
-    int total_unused_size = 0;
-    int main_chain_len = 0;
-    printf("\n--- MeMS System Stats ---\n");
-    while (current_main_node != head_main) {
-        total_pages += current_main_node->num_of_pages;
-        printf("MAIN[%lu:%lu]-> ", (uintptr_t)current_main_node->v_addr_start, (uintptr_t)current_main_node->v_addr_end);
-        main_chain_len++;
-        struct sub_node* current_sub_node = current_main_node->sub_head;
-        while (current_sub_node != NULL) {
-            if (current_sub_node->type == HOLE) {
-                printf("H[%lu:%lu](%d) <-> ", (uintptr_t)current_sub_node->v_addr_start, (uintptr_t)current_sub_node->v_addr_end, current_sub_node->size);
-                total_unused_size += current_sub_node->size;
+    size_t partitions = mems_opt_threads < MAX_TRAVERSAL_THREADS ? mems_opt_threads : MAX_TRAVERSAL_THREADS;
+    if (partitions > count / PARALLEL_MIN_NODES) {
+        partitions = count / PARALLEL_MIN_NODES;
+    }
+    if (partitions <= 1) {
+        visit(head_main->next, count, results);
+        return 1;
+    }
+
+    struct traversal_task tasks[MAX_TRAVERSAL_THREADS];
+    pthread_t threads[MAX_TRAVERSAL_THREADS];
+    int started[MAX_TRAVERSAL_THREADS];
+    struct main_node* node = head_main->next;
+    for (size_t i = 0; i < partitions; i++) {
+        tasks[i].first = node;
+        tasks[i].count = count / partitions + (i < count % partitions ? 1 : 0);
+        tasks[i].visit = visit;
+        tasks[i].result = (char*)results + i * result_size;
+        for (size_t skipped = 0; skipped < tasks[i].count; skipped++) {
+            node = node->next;
+        }
+        // The calling thread takes the last run itself; workers start while it walks
+        started[i] = i + 1 < partitions && pthread_create(&threads[i], NULL, traversal_worker, &tasks[i]) == 0;
+    }
+    for (size_t i = 0; i < partitions; i++) {
+        if (!started[i]) {
+            traversal_worker(&tasks[i]);
+        }
+    }
+    for (size_t i = 0; i < partitions; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    return partitions;
+}
+
+// Aggregate figures describing the current state of the heap
+struct mems_stats {
+    size_t pages;
+    size_t main_chain_len;
+    size_t segments;
+    size_t processes;
+    size_t holes;
+    size_t used_bytes;
+    size_t unused_bytes;
+    size_t largest_hole;
+    size_t padding_bytes;  // Held by PAD segments of isolated allocations
+};
+
+void stats_visit(struct main_node* first, size_t count, void* result) {
+    struct mems_stats* stats = (struct mems_stats*)result;
+    memset(stats, 0, sizeof(*stats));
+    struct main_node* current_main_node = first;
+    for (size_t i = 0; i < count; i++) {
+        stats->pages += current_main_node->num_of_pages;
+        stats->main_chain_len++;
+        for (struct sub_node* sub = current_main_node->sub_head; sub != NULL; sub = sub->next) {
+            stats->segments++;
+            if (sub->type == HOLE) {
+                stats->holes++;
+                stats->unused_bytes += sub->size;
+                if ((size_t)sub->size > stats->largest_hole) {
+                    stats->largest_hole = sub->size;
+                }
+            } else if (sub->type == PAD) {
+                stats->padding_bytes += sub->size;
             } else {
-                printf("P[%lu:%lu](%d) <-> ", (uintptr_t)current_sub_node->v_addr_start, (uintptr_t)current_sub_node->v_addr_end, current_sub_node->size);
+                stats->processes++;
+                stats->used_bytes += sub->size;
             }
-            current_sub_node = current_sub_node->next;
         }
         current_main_node = current_main_node->next;
-        printf("NULL\n");
     }
-    printf("Pages used: %d\n", total_pages);
-    printf("Space unused: %d bytes\n", total_unused_size);
-    printf("Main chain length: %d\n", main_chain_len);
-    printf("-------------------------\n");
 }
 
 /*
- * Translates a MeMS virtual address to its corresponding physical address.
- * @param v_ptr The MeMS virtual address to translate.
- * @return The corresponding physical address, or NULL if the address is invalid.
+ * Computes heap statistics, traversing the main chain in parallel and
+ * reducing the per-thread partial results.
+ * @param stats Receives the totals.
  */
-void* mems_get(void* v_ptr) {
-    struct main_node* current_main_node = head_main->next;
-    while (current_main_node != head_main) {
-        // Quick check to see if v_ptr is within this main node's range
-        if (v_ptr >= current_main_node->v_addr_start && v_ptr <= current_main_node->v_addr_end) {
-            struct sub_node* current_sub_node = current_main_node->sub_head;
-            while (current_sub_node != NULL) {
-                if (v_ptr >= current_sub_node->v_addr_start && v_ptr <= current_sub_node->v_addr_end) {
-                    if (current_sub_node->type == PROCESS) {
-                        return current_sub_node->p_addr + (v_ptr - current_sub_node->v_addr_start);
-                    } else {
-                        return NULL; // Address points to a hole
-                    }
-                }
-                current_sub_node = current_sub_node->next;
-            }
+void mems_get_stats(struct mems_stats* stats) {
+    pthread_mutex_lock(&mems_lock);
+    struct mems_stats partial[MAX_TRAVERSAL_THREADS];
+    size_t filled = parallel_traverse(stats_visit, partial, sizeof(partial[0]));
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < filled; i++) {
+        stats->pages += partial[i].pages;
+        stats->main_chain_len += partial[i].main_chain_len;
+        stats->segments += partial[i].segments;
+        stats->processes += partial[i].processes;
+        stats->holes += partial[i].holes;
+        stats->used_bytes += partial[i].used_bytes;
+        stats->unused_bytes += partial[i].unused_bytes;
+        stats->padding_bytes += partial[i].padding_bytes;
+        if (partial[i].largest_hole > stats->largest_hole) {
+            stats->largest_hole = partial[i].largest_hole;
         }
-        current_main_node = current_main_node->next;
     }
-    return NULL; // Address not found in any managed segment
+    pthread_mutex_unlock(&mems_lock);
 }
 
-void merge_holes() {
-    struct main_node* current_main_node = head_main->next;
-    while (current_main_node != head_main) {
-        struct sub_node* current_sub_node = current_main_node->sub_head;
-        while (current_sub_node != NULL) {
-            if (current_sub_node->type == HOLE && current_sub_node->next != NULL && current_sub_node->next->type == HOLE) {
-                struct sub_node* next_hole = current_sub_node->next;
-                current_sub_node->size += next_hole->size;
-                current_sub_node->v_addr_end = next_hole->v_addr_end;
-                current_sub_node->next = next_hole->next;
-                if (next_hole->next != NULL) {
-                    next_hole->next->prev = current_sub_node;
+void check_failed(struct main_node* node, const char* what, size_t* errors) {
+    fprintf(stderr, "MeMS check: MAIN[%lu:%lu] %s\n", (uintptr_t)node->v_addr_start, (uintptr_t)node->v_addr_end, what);
+    (*errors)++;
+}
+
+void check_visit(struct main_node* first, size_t count, void* result) {
+    size_t* errors = (size_t*)result;
+    *errors = 0;
+    struct main_node* node = first;
+    for (size_t i = 0; i < count; i++) {
+        if (node->next->prev != node) {
+            check_failed(node, "next->prev does not point back", errors);
+        }
+        if (node->next != head_main && node->v_addr_end >= node->next->v_addr_start) {
+            check_failed(node, "overlaps the next main_node", errors);
+        }
+        if (mems_opt_tagged_vaddr && (((uintptr_t)node->v_addr_start & TAG_OFFSET_MASK) != 0 ||
+                                      find_main_node(node->v_addr_start) != node ||
+                                      find_main_node(node->v_addr_end) != node)) {
+            check_failed(node, "is not found through its address tag", errors);
+        }
+        if ((char*)node->v_addr_end - (char*)node->v_addr_start + 1 != (intptr_t)node->num_of_pages * PAGE_SIZE) {
+            check_failed(node, "virtual range does not match its page count", errors);
+        }
+        if (node->sub_head == NULL || node->sub_head->prev != NULL || node->sub_head->v_addr_start != node->v_addr_start) {
+            check_failed(node, "segment list does not start at the main_node", errors);
+        }
+
+        size_t total = 0;
+        struct sub_node* last = NULL;
+        for (struct sub_node* sub = node->sub_head; sub != NULL; sub = sub->next) {
+            total += sub->size;
+            if (sub->type != HOLE && sub->type != PROCESS && sub->type != PAD) {
+                check_failed(node, "segment has an unknown type", errors);
+            }
+            if (sub->type == PAD && (sub->prev == NULL || sub->prev->type != PROCESS)) {
+                check_failed(node, "padding does not follow an allocated segment", errors);
+            }
+            if (sub->size <= 0 || (char*)sub->v_addr_end - (char*)sub->v_addr_start + 1 != sub->size) {
+                check_failed(node, "segment size does not match its range", errors);
+            }
+            if ((char*)sub->p_addr - (char*)node->p_addr != (char*)sub->v_addr_start - (char*)node->v_addr_start) {
+                check_failed(node, "segment physical address is out of place", errors);
+            }
+            if (sub->next != NULL) {
+                if (sub->next->prev != sub) {
+                    check_failed(node, "segment next->prev does not point back", errors);
+                }
+                if (sub->next->v_addr_start != sub->v_addr_end + 1) {
+                    check_failed(node, "segments are not contiguous", errors);
+                }
+                if (sub->type == HOLE && sub->next->type == HOLE) {
+                    check_failed(node, "adjacent holes were not merged", errors);
                 }
-                // In a production system, the `next_hole` struct itself would be returned to a pool
-                continue; // Re-check the current node in case it can merge again
             }
-            current_sub_node = current_sub_node->next;
+            last = sub;
         }
-        current_main_node = current_main_node->next;
+        if (last != NULL && last->v_addr_end != node->v_addr_end) {
+            check_failed(node, "segment list does not end at the main_node", errors);
+        }
+        if (total != (size_t)node->num_of_pages * PAGE_SIZE) {
+            check_failed(node, "segment sizes do not add up to the mapping", errors);
+        }
+        node = node->next;
     }
 }
 
 /*
- * Frees a previously allocated memory segment.
- * The freed segment is marked as a HOLE and merged with adjacent holes.
- * @param v_ptr The MeMS virtual address of the segment to free.
+ * Verifies the consistency of the main chain and every segment list,
+ * checking runs of the chain in parallel. Each problem found is reported
+ * on stderr.
+ * @return The number of inconsistencies found, 0 for a healthy heap.
  */
-void mems_free(void* v_ptr) {
-    if(v_ptr == NULL) return;
+size_t mems_check() {
+    pthread_mutex_lock(&mems_lock);
+    size_t partial[MAX_TRAVERSAL_THREADS];
+    size_t filled = parallel_traverse(check_visit, partial, sizeof(partial[0]));
+    size_t errors = 0;
+    for (size_t i = 0; i < filled; i++) {
+        errors += partial[i];
+    }
+    pthread_mutex_unlock(&mems_lock);
+    return errors;
+}
 
-    struct main_node* current_main_node = head_main->next;
-    while (current_main_node != head_main) {
-        struct sub_node* current_sub_node = current_main_node->sub_head;
-        while (current_sub_node != NULL) {
-            if (current_sub_node->v_addr_start == v_ptr && current_sub_node->type == PROCESS) {
-                current_sub_node->type = HOLE;
-                merge_holes();
-                return;
-            }
-            current_sub_node = current_sub_node->next;
+void unmap_visit(struct main_node* first, size_t count, void* result) {
+    struct main_node* node = first;
+    for (size_t i = 0; i < count; i++) {
+        if (munmap(node->p_addr, node->num_of_pages * PAGE_SIZE) == -1) {
+            perror("munmap failed on mems_finish");
+        }
+        node = node->next;
+    }
+}
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void log_tune_decision(const char* param, double old_value, double new_value, const char* reason) {
+    struct tune_decision* decision = &tune_log[tune_decisions_total % TUNE_LOG_SIZE];
+    decision->pass = adaptive_passes;
+    decision->param = param;
+    decision->old_value = old_value;
+    decision->new_value = new_value;
+    decision->reason = reason;
+    tune_decisions_total++;
+}
+
+/*
+ * Retunes the growth factor, split threshold and purge decay from the
+ * observations of the window that just ended:
+ *  - frequent new mappings with little unused space raise the growth factor,
+ *    heavy fragmentation lowers it again;
+ *  - leftovers smaller than the smallest commonly requested size are never
+ *    reused, so the split threshold follows that size;
+ *  - fragmentation makes purging more frequent, while a rising free latency
+ *    backs it off.
+ */
+/*
+ * Derives a split threshold from a size histogram: leftovers smaller than
+ * the smallest size bucket holding at least 5% of the requests are not
+ * worth keeping as separate holes.
+ * @return The threshold, or 0 if no bucket is that common.
+ */
+size_t split_threshold_for(const size_t* histogram, size_t total) {
+    size_t split = 0;
+    for (int bucket = 0; bucket < SIZE_BUCKETS; bucket++) {
+        if (histogram[bucket] * 20 >= total) {
+            split = ((size_t)1 << bucket) - 1;
+            break;
+        }
+    }
+    if (split == 0 && (total == 0 || histogram[0] * 20 < total)) {
+        return 0;
+    }
+    if (split < sizeof(struct sub_node)) {
+        split = sizeof(struct sub_node);
+    }
+    if (split > mems_opt_adaptive_split_max) {
+        split = mems_opt_adaptive_split_max;
+    }
+    return split;
+}
+
+void adaptive_tune() {
+    struct adaptive_window* window = &adaptive_window;
+    adaptive_passes++;
+
+    struct mems_stats stats;
+    mems_get_stats(&stats);
+    size_t mapped = stats.pages * PAGE_SIZE;
+    double fragmentation = mapped != 0 ? (double)stats.unused_bytes / (double)mapped : 0.0;
+
+    double growth = mems_opt_growth_factor;
+    if (fragmentation > 0.5 && growth > 1.0) {
+        growth = growth / 2 < 1.0 ? 1.0 : growth / 2;
+        log_tune_decision("opt.growth_factor", mems_opt_growth_factor, growth, "fragmentation above 50%");
+    } else if (fragmentation < 0.25 && window->mappings * 64 > window->mallocs && growth < mems_opt_adaptive_growth_max) {
+        growth = growth * 2 > mems_opt_adaptive_growth_max ? mems_opt_adaptive_growth_max : growth * 2;
+        log_tune_decision("opt.growth_factor", mems_opt_growth_factor, growth, "frequent new mappings");
+    }
+    mems_opt_growth_factor = growth;
+
+    if (window->mallocs != 0) {
+        size_t split = split_threshold_for(window->size_histogram, window->mallocs);
+        if (split != 0 && split != mems_opt_split_threshold) {
+            log_tune_decision("opt.split_threshold", mems_opt_split_threshold, split, "smallest common request size changed");
+            mems_opt_split_threshold = split;
+        }
+    }
+
+    uint64_t mean_free_ns = window->frees != 0 ? window->free_ns / window->frees : 0;
+    size_t decay = mems_opt_purge_decay;
+    if (adaptive_prev_free_ns != 0 && mean_free_ns > adaptive_prev_free_ns + adaptive_prev_free_ns / 2 && decay != 0) {
+        decay = decay * 2 > mems_opt_adaptive_decay_max ? mems_opt_adaptive_decay_max : decay * 2;
+        if (decay != mems_opt_purge_decay) {
+            log_tune_decision("opt.purge_decay", mems_opt_purge_decay, decay, "free latency rising");
+        }
+    } else if (fragmentation > 0.5) {
+        decay = decay == 0 ? mems_opt_adaptive_decay_max : decay / 2;
+        if (decay < mems_opt_adaptive_decay_min) {
+            decay = mems_opt_adaptive_decay_min;
+        }
+        if (decay != mems_opt_purge_decay) {
+            log_tune_decision("opt.purge_decay", mems_opt_purge_decay, decay, "fragmentation above 50%");
         }
-        current_main_node = current_main_node->next;
     }
-}
\ No newline at end of file
+    mems_opt_purge_decay = decay;
+
+    if (window->frees != 0) {
+        adaptive_prev_free_ns = mean_free_ns;
+    }
+    memset(window, 0, sizeof(*window));
+}
+
+// Counts one operation towards the current window and retunes when it is full
+void adaptive_tick() {
+    if (++adaptive_window.ops >= mems_opt_adaptive_interval) {
+        adaptive_tune();
+    }
+}
+
+// The power-of-two bucket of a request size: bucket b holds sizes in [2^b, 2^(b+1))
+int size_bucket(size_t size) {
+    int bucket = 0;
+    while (bucket < SIZE_BUCKETS - 1 && ((size_t)2 << bucket) <= size) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void adaptive_record_malloc(size_t size) {
+    int bucket = size_bucket(size);
+    adaptive_window.mallocs++;
+    adaptive_window.size_histogram[bucket]++;
+    adaptive_tick();
+}
+
+// Value types understood by mems_ctl()
+#define CTL_SIZE 0
+#define CTL_DOUBLE 1
+#define CTL_ACTION 2
+
+// A named entry of the mems_ctl() namespace
+struct ctl_entry {
+    const char* name;
+    int type;
+    void* value;
+    int writable;
+    double min;             // Inclusive bounds accepted on write
+    double max;
+    void (*action)();       // Run for CTL_ACTION entries
+};
+
+size_t ctl_page_size = PAGE_SIZE;
+
+void mems_reset();
+void mems_tcache_flush();
+int mems_pressure_start();
+void mems_pressure_stop();
+void rss_pace();
+int mems_profile_save(const char* path);
+int mems_profile_load(const char* path);
+void profile_reset();
+void mems_lifetime_report(FILE* out);
+void lifetime_reset();
+void flight_dump_stderr();
+int mems_flight_signal(int signo);
+int write_all(int fd, const void* buf, size_t len);
+
+void ctl_purge() {
+    purge_holes();
+    frees_since_purge = 0;
+}
+
+struct ctl_entry ctl_entries[] = {
+    {"opt.growth_factor", CTL_DOUBLE, &mems_opt_growth_factor, 1, 1.0, 1024.0, NULL},
+    {"opt.split_threshold", CTL_SIZE, &mems_opt_split_threshold, 1, 0, 1 << 30, NULL},
+    {"opt.purge_decay", CTL_SIZE, &mems_opt_purge_decay, 1, 0, 1e18, NULL},
+    {"opt.mremap_threshold", CTL_SIZE, &mems_opt_mremap_threshold, 1, 0, 1e18, NULL},
+    {"tcache.max", CTL_SIZE, &mems_opt_tcache_max, 1, 1, 1 << 20, NULL},
+    {"opt.tcache_steal", CTL_SIZE, &mems_opt_tcache_steal, 1, 0, 1, NULL},
+    {"opt.slab_colors", CTL_SIZE, &mems_opt_slab_colors, 1, 1, PAGE_SIZE / 64, NULL},
+    {"tcache.flush", CTL_ACTION, NULL, 0, 0, 0, mems_tcache_flush},
+    {"opt.nt_threshold", CTL_SIZE, &mems_opt_nt_threshold, 1, 0, 1e18, NULL},
+    {"opt.threads", CTL_SIZE, &mems_opt_threads, 1, 1, MAX_TRAVERSAL_THREADS, NULL},
+    {"opt.tagged_vaddr", CTL_SIZE, &mems_opt_tagged_vaddr, 1, 0, 1, NULL},
+    {"opt.isolation_line", CTL_SIZE, &mems_opt_isolation_line, 1, 1, PAGE_SIZE, NULL},
+    {"opt.lifetime_sample", CTL_SIZE, &mems_opt_lifetime_sample, 1, 0, 1e18, NULL},
+    {"opt.flight_events", CTL_SIZE, &mems_opt_flight_events, 1, 0, 1 << 20, NULL},
+    {"opt.flight_signal", CTL_SIZE, &mems_opt_flight_signal, 1, 0, 64, NULL},
+    {"flight.dump", CTL_ACTION, NULL, 0, 0, 0, flight_dump_stderr},
+    {"opt.pressure", CTL_SIZE, &mems_opt_pressure, 1, 0, 1, NULL},
+    {"opt.pressure_interval_ms", CTL_SIZE, &mems_opt_pressure_interval_ms, 1, 1, 3600000, NULL},
+    {"opt.pressure_psi", CTL_DOUBLE, &mems_opt_pressure_psi, 1, 0.0, 100.0, NULL},
+    {"opt.pressure_cgroup", CTL_DOUBLE, &mems_opt_pressure_cgroup, 1, 0.0, 1.0, NULL},
+    {"opt.rss_target", CTL_SIZE, &mems_opt_rss_target, 1, 0, 1e18, NULL},
+    {"opt.rss_interval", CTL_SIZE, &mems_opt_rss_interval, 1, 1, 1e18, NULL},
+    {"opt.rss_step", CTL_SIZE, &mems_opt_rss_step, 1, PAGE_SIZE, 1e18, NULL},
+    {"opt.adaptive", CTL_SIZE, &mems_opt_adaptive, 1, 0, 1, NULL},
+    {"opt.adaptive_interval", CTL_SIZE, &mems_opt_adaptive_interval, 1, 1, 1e18, NULL},
+    {"opt.adaptive_growth_max", CTL_DOUBLE, &mems_opt_adaptive_growth_max, 1, 1.0, 1024.0, NULL},
+    {"opt.adaptive_split_max", CTL_SIZE, &mems_opt_adaptive_split_max, 1, 0, 1 << 30, NULL},
+    {"opt.adaptive_decay_min", CTL_SIZE, &mems_opt_adaptive_decay_min, 1, 1, 1e18, NULL},
+    {"opt.adaptive_decay_max", CTL_SIZE, &mems_opt_adaptive_decay_max, 1, 1, 1e18, NULL},
+    {"arenas.page", CTL_SIZE, &ctl_page_size, 0, 0, 0, NULL},
+    {"arena.0.purge", CTL_ACTION, NULL, 0, 0, 0, ctl_purge},
+    {"arena.0.reset", CTL_ACTION, NULL, 0, 0, 0, mems_reset},
+    {"stats.adaptive.passes", CTL_SIZE, &adaptive_passes, 0, 0, 0, NULL},
+    {"stats.adaptive.decisions", CTL_SIZE, &tune_decisions_total, 0, 0, 0, NULL},
+    {"stats.tcache.slabs", CTL_SIZE, &tcache_slabs, 0, 0, 0, NULL},
+    {"stats.tcache.steals", CTL_SIZE, &tcache_steals, 0, 0, 0, NULL},
+    {"stats.mapped_pages", CTL_SIZE, &mapped_pages, 0, 0, 0, NULL},
+    {"stats.peak_pages", CTL_SIZE, &peak_pages, 0, 0, 0, NULL},
+    {"stats.pressure.level", CTL_SIZE, &pressure_level, 0, 0, 0, NULL},
+    {"stats.pressure.escalations", CTL_SIZE, &pressure_escalations, 0, 0, 0, NULL},
+    {"stats.pressure.released", CTL_SIZE, &pressure_released, 0, 0, 0, NULL},
+    {"stats.rss.resident", CTL_SIZE, &rss_resident, 0, 0, 0, NULL},
+    {"stats.rss.steps", CTL_SIZE, &rss_steps, 0, 0, 0, NULL},
+    {"stats.rss.purged", CTL_SIZE, &rss_purged, 0, 0, 0, NULL},
+    {"stats.lifetime.sampled", CTL_SIZE, &lifetime_sampled, 0, 0, 0, NULL},
+    {"stats.lifetime.freed", CTL_SIZE, &lifetime_freed, 0, 0, 0, NULL},
+};
+
+// mems_ctl() for callers already holding mems_lock
+int mems_ctl_unlocked(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen) {
+    struct ctl_entry* entry = NULL;
+    for (size_t i = 0; i < sizeof(ctl_entries) / sizeof(ctl_entries[0]); i++) {
+        if (strcmp(ctl_entries[i].name, name) == 0) {
+            entry = &ctl_entries[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        return ENOENT;
+    }
+
+    if (entry->type == CTL_ACTION) {
+        if (oldp != NULL || newp != NULL) {
+            return EINVAL;
+        }
+        entry->action();
+        return 0;
+    }
+
+    size_t value_size = entry->type == CTL_DOUBLE ? sizeof(double) : sizeof(size_t);
+    if (oldp != NULL) {
+        if (oldlenp == NULL || *oldlenp != value_size) {
+            return EINVAL;
+        }
+        memcpy(oldp, entry->value, value_size);
+    }
+    if (newp != NULL) {
+        if (!entry->writable) {
+            return EPERM;
+        }
+        if (newlen != value_size) {
+            return EINVAL;
+        }
+        if (entry->value == &mems_opt_tagged_vaddr && head_main != NULL && main_slots_len != 0) {
+            return EBUSY; // The address format cannot change once memory is mapped
+        }
+        double requested = entry->type == CTL_DOUBLE ? *(double*)newp : (double)*(size_t*)newp;
+        if (requested < entry->min || requested > entry->max) {
+            return EINVAL;
+        }
+        memcpy(entry->value, newp, value_size);
+    }
+    return 0;
+}
+
+/*
+ * Reads and/or writes a named MeMS parameter, in the style of mallctl().
+ * Names are dot separated, e.g. "opt.growth_factor" or "arena.0.purge".
+ * Actions such as "arena.0.purge" take no value; calling them runs them.
+ * @param name The parameter name.
+ * @param oldp If non-NULL, receives the current value.
+ * @param oldlenp Size of the buffer at oldp; must match the value size.
+ * @param newp If non-NULL, the new value to store.
+ * @param newlen Size of the value at newp; must match the value size.
+ * @return 0 on success, ENOENT for unknown names, EPERM for read-only
+ *         parameters, EINVAL for size mismatches or out-of-range values and
+ *         EBUSY for opt.tagged_vaddr once memory has been mapped.
+ */
+int mems_ctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen) {
+    pthread_mutex_lock(&mems_lock);
+    int ret = mems_ctl_unlocked(name, oldp, oldlenp, newp, newlen);
+    pthread_mutex_unlock(&mems_lock);
+    return ret;
+}
+
+/*
+ * Applies a MEMS_CONF style option string of the form
+ * "growth_factor:2,purge_decay:64". Keys are the "opt." parameters of
+ * mems_ctl() without the prefix. Invalid options are reported and skipped.
+ * @param conf The option string.
+ */
+void parse_conf(const char* conf) {
+    char key[64];
+    char value[64];
+    const char* cursor = conf;
+    while (*cursor != '\0') {
+        size_t key_len = strcspn(cursor, ":,");
+        size_t value_len = 0;
+        const char* value_start = cursor + key_len;
+        if (*value_start == ':') {
+            value_start++;
+            value_len = strcspn(value_start, ",");
+        }
+        const char* next = value_start + value_len;
+
+        if (key_len > 0 && key_len < sizeof(key) - 4 && value_len > 0 && value_len < sizeof(value)) {
+            snprintf(key, sizeof(key), "opt.%.*s", (int)key_len, cursor);
+            memcpy(value, value_start, value_len);
+            value[value_len] = '\0';
+
+            int ret = ENOENT;
+            char* end;
+            for (size_t i = 0; i < sizeof(ctl_entries) / sizeof(ctl_entries[0]); i++) {
+                if (strcmp(ctl_entries[i].name, key) != 0) {
+                    continue;
+                }
+                if (ctl_entries[i].type == CTL_DOUBLE) {
+                    double parsed = strtod(value, &end);
+                    ret = *end == '\0' ? mems_ctl(key, NULL, NULL, &parsed, sizeof(parsed)) : EINVAL;
+                } else {
+                    size_t parsed = strtoull(value, &end, 0);
+                    ret = *end == '\0' ? mems_ctl(key, NULL, NULL, &parsed, sizeof(parsed)) : EINVAL;
+                }
+                break;
+            }
+            if (ret != 0) {
+                fprintf(stderr, "MeMS: ignoring MEMS_CONF option \"%s:%s\" (%s)\n", key + 4, value,
+                        ret == ENOENT ? "unknown option" : "invalid value");
+            }
+        } else if (key_len > 0 || value_len > 0) {
+            fprintf(stderr, "MeMS: malformed MEMS_CONF option \"%.*s\"\n", (int)(next - cursor), cursor);
+        }
+        cursor = *next == ',' ? next + 1 : next;
+    }
+}
+
+/*
+ * Initializes the MeMS system, setting up the free list and
+ * other necessary global variables. Tunables given in the MEMS_CONF
+ * environment variable are applied here, the heap is warmed up from the
+ * profile named by MEMS_PROFILE if one exists, the memory pressure
+ * monitor is started if opt.pressure is set, and opt.flight_signal is made
+ * to dump the flight recorder.
+ */
+void mems_init() {
+    init_free_list();
+    const char* conf = getenv("MEMS_CONF");
+    if (conf != NULL) {
+        parse_conf(conf);
+    }
+    head_main = add_main_node();
+    head_main->num_of_pages = 0;
+    head_main->next = head_main;
+    head_main->prev = head_main;
+    head_main->sub_head = NULL;
+    start_virtual_address = (void *)START_VIRTUAL_ADDRESS;
+    head_main->v_addr_start = start_virtual_address;
+    head_main->v_addr_end = start_virtual_address-1;
+    profile_reset();
+    const char* profile = getenv("MEMS_PROFILE");
+    if (profile != NULL && access(profile, R_OK) == 0) {
+        mems_profile_load(profile);
+    }
+    if (mems_opt_pressure) {
+        mems_pressure_start();
+    }
+    if (mems_opt_flight_signal != 0) {
+        mems_flight_signal((int)mems_opt_flight_signal);
+    }
+}
+
+/*
+ * Deallocates all memory managed by the MeMS system.
+ * It unmaps all memory regions previously obtained from the OS via mmap,
+ * issuing the munmap calls from up to mems_opt_threads threads. If
+ * MEMS_PROFILE is set, the allocation profile of the run is saved there
+ * first, and if the lifetime profiler sampled anything, its report is
+ * printed on stderr.
+ */
+void mems_finish() {
+    mems_pressure_stop();
+    if (lifetime_sampled != 0) {
+        mems_lifetime_report(stderr);
+        lifetime_reset();
+    }
+    const char* profile = getenv("MEMS_PROFILE");
+    if (profile != NULL) {
+        mems_profile_save(profile);
+    }
+    pthread_mutex_lock(&mems_lock);
+    size_t unused[MAX_TRAVERSAL_THREADS];
+    parallel_traverse(unmap_visit, unused, sizeof(unused[0]));
+    head_main->next = head_main;
+    head_main->prev = head_main;
+    main_slots_len = 0;
+    mapped_pages = 0;
+    mems_epoch++;
+    __atomic_add_fetch(&tcache_generation, 1, __ATOMIC_RELEASE);
+    // Note: The pages used for tracking nodes are not unmapped here
+    // in this implementation, as they are managed by the OS heap.
+    // A more robust implementation might track and free these as well.
+    pthread_mutex_unlock(&mems_lock);
+}
+
+/*
+ * Discards every allocation at once while keeping all mappings.
+ * Each main_node becomes a single HOLE spanning its pages and the old
+ * sub_nodes are recycled. The physical pages stay mapped and resident, so
+ * the next round of allocations reuses warm memory without mmap calls or
+ * page faults. All previously returned MeMS virtual addresses become invalid,
+ * except those inside buffer pools, which are left untouched.
+ */
+void mems_reset() {
+    pthread_mutex_lock(&mems_lock);
+    struct main_node* current_main_node = head_main->next;
+    while (current_main_node != head_main) {
+        if (current_main_node->flags & MAIN_LOCKED) {
+            current_main_node = current_main_node->next;
+            continue;
+        }
+        struct sub_node* current_sub_node = current_main_node->sub_head;
+        while (current_sub_node != NULL) {
+            struct sub_node* next = current_sub_node->next;
+            release_sub_node(current_sub_node);
+            current_sub_node = next;
+        }
+
+        struct sub_node* hole = add_sub_node();
+        hole->type = HOLE;
+        hole->size = current_main_node->num_of_pages * PAGE_SIZE;
+        hole->p_addr = current_main_node->p_addr;
+        hole->v_addr_start = current_main_node->v_addr_start;
+        hole->v_addr_end = current_main_node->v_addr_end;
+        hole->next = NULL;
+        hole->prev = NULL;
+        current_main_node->sub_head = hole;
+        current_main_node = current_main_node->next;
+    }
+    frees_since_purge = 0;
+    mems_epoch++;
+    __atomic_add_fetch(&tcache_generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mems_lock);
+}
+
+/*
+* Flight recorder. Every thread that calls into MeMS owns a ring of the
+* last opt.flight_events events: the operation, its size and address, the
+* path it took and when it started and how many cycles it took. Only the
+* owning thread writes its ring, so recording takes no lock; readers check
+* each slot's sequence number before and after copying it and skip slots
+* that were being rewritten. Rings are linked into a registry that is only
+* ever pushed to, and a ring whose thread exited is handed to the next new
+* thread. mems_flight_dump() prints every ring and is async-signal-safe.
+*/
+#define FLIGHT_MALLOC 1
+#define FLIGHT_MALLOC_NEAR 2
+#define FLIGHT_MALLOC_ISOLATED 3
+#define FLIGHT_FREE 4
+#define FLIGHT_REALLOC 5
+#define FLIGHT_EXTEND 6
+#define FLIGHT_TCACHE_ALLOC 7
+#define FLIGHT_TCACHE_FREE 8
+
+#define FLIGHT_PATH_NONE 0
+#define FLIGHT_PATH_HOLE 1     // Reused a hole
+#define FLIGHT_PATH_MAP 2      // Mapped new pages
+#define FLIGHT_PATH_IN_PLACE 3 // Grew into the following hole
+#define FLIGHT_PATH_REMAP 4    // Grew the mapping with mremap
+#define FLIGHT_PATH_MOVE 5     // Copied to a new segment
+#define FLIGHT_PATH_BIN 6      // Served by the thread cache bin
+#define FLIGHT_PATH_DEPOT 7    // Refilled from the shared depot
+#define FLIGHT_PATH_SLAB 8     // Refilled by carving a new slab
+#define FLIGHT_PATH_SPILL 9    // Spilled half the bin to the depot
+#define FLIGHT_PATH_FAIL 10
+#define FLIGHT_PATH_BATCH 11   // Refilled from a batch on the thread's own deque
+#define FLIGHT_PATH_STEAL 12   // Refilled with a batch stolen from another thread
+
+const char* flight_op_names[] = {"-", "malloc", "malloc_near", "malloc_isolated", "free",
+                                 "realloc", "extend", "tcache_alloc", "tcache_free"};
+const char* flight_path_names[] = {"-", "hole", "map", "in_place", "remap", "move",
+                                   "bin", "depot", "slab", "spill", "fail", "batch", "steal"};
+
+struct flight_event {
+    uint64_t start;    // Cycle counter when the operation started
+    void* addr;
+    uint32_t size;     // Segment sizes never exceed INT32_MAX
+    uint32_t cycles;   // Duration of the operation, saturated
+    uint32_t seq;      // Low bits of 1 + the event's index in the ring, 0 while it is written
+    uint8_t op;
+    uint8_t path;
+    uint16_t unused;
+};
+
+struct flight_ring {
+    struct flight_ring* next; // Registry link, rings are never unlinked
+    int in_use;               // 0 once the owning thread exited
+    pid_t tid;
+    uint64_t head;            // Events recorded so far
+    uint64_t mask;            // Capacity - 1, the capacity being a power of two
+    struct flight_event events[];
+};
+
+struct flight_ring* flight_rings = NULL;
+__thread struct flight_ring* flight_ring = NULL;
+__thread int flight_path = FLIGHT_PATH_NONE; // Set by the internals for the operation in progress
+pthread_key_t flight_key;
+pthread_once_t flight_once = PTHREAD_ONCE_INIT;
+
+uint64_t flight_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+// The cycle counter at the start of an operation, 0 when recording is off
+uint64_t flight_start() {
+    flight_path = FLIGHT_PATH_NONE;
+    return mems_opt_flight_events != 0 ? flight_cycles() : 0;
+}
+
+// Runs when a thread that owns a ring exits
+void flight_release(void* ring) {
+    __atomic_store_n(&((struct flight_ring*)ring)->in_use, 0, __ATOMIC_RELEASE);
+    flight_ring = NULL;
+}
+
+void flight_key_create() {
+    pthread_key_create(&flight_key, flight_release);
+}
+
+// Gives the calling thread a ring, reusing one left by an exited thread if possible
+struct flight_ring* flight_ring_claim() {
+    pthread_once(&flight_once, flight_key_create);
+    struct flight_ring* ring = __atomic_load_n(&flight_rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        int expected = 0;
+        if (__atomic_load_n(&ring->in_use, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&ring->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        size_t capacity = 1;
+        while (capacity < mems_opt_flight_events) {
+            capacity *= 2;
+        }
+        ring = (struct flight_ring*)mmap(NULL, sizeof(struct flight_ring) + capacity * sizeof(struct flight_event),
+                                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            return NULL;
+        }
+        ring->in_use = 1;
+        ring->mask = capacity - 1;
+        ring->next = __atomic_load_n(&flight_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&flight_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    } else {
+        for (uint64_t i = 0; i <= ring->mask; i++) {
+            __atomic_store_n(&ring->events[i].seq, 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+    }
+    ring->tid = (pid_t)syscall(SYS_gettid);
+    pthread_setspecific(flight_key, ring);
+    flight_ring = ring;
+    return ring;
+}
+
+/*
+ * Appends an event to the calling thread's ring. The path is the one the
+ * internals stored in flight_path, or fail if no address was produced.
+ * @param start The value flight_start() returned when the operation began.
+ */
+void flight_record(int op, size_t size, void* addr, uint64_t start) {
+    int path = addr != NULL ? flight_path : FLIGHT_PATH_FAIL;
+    flight_path = FLIGHT_PATH_NONE;
+    if (start == 0 || mems_opt_flight_events == 0) {
+        return;
+    }
+    struct flight_ring* ring = flight_ring != NULL ? flight_ring : flight_ring_claim();
+    if (ring == NULL) {
+        return;
+    }
+    uint64_t cycles = flight_cycles() - start;
+    uint64_t head = ring->head;
+    struct flight_event* event = &ring->events[head & ring->mask];
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->start = start;
+    event->addr = addr;
+    event->size = size < UINT32_MAX ? (uint32_t)size : UINT32_MAX;
+    event->cycles = cycles < UINT32_MAX ? (uint32_t)cycles : UINT32_MAX;
+    event->op = (uint8_t)op;
+    event->path = (uint8_t)path;
+    __atomic_store_n(&event->seq, (uint32_t)(head + 1), __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Appends a string to a line being formatted; snprintf is not async-signal-safe
+char* flight_put(char* p, const char* s) {
+    while (*s != '\0') {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+char* flight_put_number(char* p, uint64_t value, unsigned int base) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+    if (base == 16) {
+        p = flight_put(p, "0x");
+    }
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+/*
+ * Writes the events of every ring, oldest first, with their start relative
+ * to the time of the dump. Safe to call from a signal handler, including
+ * one interrupting MeMS on the same thread.
+ * @param fd The file descriptor to write to.
+ * @return The number of events written, or -1 if writing failed.
+ */
+ssize_t mems_flight_dump(int fd) {
+    char line[256];
+    char* p = flight_put(line, "\n--- MeMS Flight Recorder (cycles before dump, op, size, address, path, cycles taken) ---\n");
+    if (write_all(fd, line, p - line) != 0) {
+        return -1;
+    }
+    uint64_t now = flight_cycles();
+    ssize_t written = 0;
+    for (struct flight_ring* ring = __atomic_load_n(&flight_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > ring->mask + 1 ? head - ring->mask - 1 : 0;
+        p = flight_put(line, "thread ");
+        p = flight_put_number(p, (uint64_t)ring->tid, 10);
+        p = flight_put(p, __atomic_load_n(&ring->in_use, __ATOMIC_RELAXED) ? "" : " (exited)");
+        p = flight_put(p, ", ");
+        p = flight_put_number(p, head, 10);
+        p = flight_put(p, " events\n");
+        if (write_all(fd, line, p - line) != 0) {
+            return -1;
+        }
+        for (uint64_t i = first; i < head; i++) {
+            struct flight_event* slot = &ring->events[i & ring->mask];
+            uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            struct flight_event event = *slot;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (seq != (uint32_t)(i + 1) || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq ||
+                event.op >= sizeof(flight_op_names) / sizeof(flight_op_names[0]) ||
+                event.path >= sizeof(flight_path_names) / sizeof(flight_path_names[0])) {
+                continue;
+            }
+            p = flight_put(line, "  ");
+            p = flight_put_number(p, now > event.start ? now - event.start : 0, 10);
+            p = flight_put(p, " ");
+            p = flight_put(p, flight_op_names[event.op]);
+            p = flight_put(p, " ");
+            p = flight_put_number(p, event.size, 10);
+            p = flight_put(p, " ");
+            p = flight_put_number(p, (uintptr_t)event.addr, 16);
+            p = flight_put(p, " ");
+            p = flight_put(p, flight_path_names[event.path]);
+            p = flight_put(p, " ");
+            p = flight_put_number(p, event.cycles, 10);
+            p = flight_put(p, "\n");
+            if (write_all(fd, line, p - line) != 0) {
+                return -1;
+            }
+            written++;
+        }
+    }
+    return written;
+}
+
+void flight_dump_stderr() {
+    mems_flight_dump(STDERR_FILENO);
+}
+
+void flight_signal_handler(int signo) {
+    (void)signo;
+    int saved_errno = errno;
+    mems_flight_dump(STDERR_FILENO);
+    errno = saved_errno;
+}
+
+/*
+ * Makes a signal dump the flight recorder on stderr, e.g.
+ * mems_flight_signal(SIGUSR2) followed by kill -USR2 <pid> during an
+ * incident. mems_init() calls this when opt.flight_signal is set.
+ * @param signo The signal to dump on.
+ * @return 0 on success, -1 if the handler could not be installed.
+ */
+int mems_flight_signal(int signo) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = flight_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signo, &action, NULL) != 0) {
+        perror("sigaction failed on mems_flight_signal");
+        return -1;
+    }
+    return 0;
+}
+
+// Grows main_slots to hold at least len slots
+int reserve_main_slots(size_t len) {
+    if (len <= main_slots_cap) {
+        return 0;
+    }
+    size_t old_size = main_slots_cap * sizeof(struct main_node*);
+    size_t new_size = old_size != 0 ? old_size : PAGE_SIZE;
+    while (new_size / sizeof(struct main_node*) < len) {
+        new_size *= 2;
+    }
+    void* slots = old_size != 0 ? mremap(main_slots, old_size, new_size, MREMAP_MAYMOVE)
+                                : mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("mmap failed on reserve_main_slots");
+        return -1;
+    }
+    main_slots = (struct main_node**)slots;
+    main_slots_cap = new_size / sizeof(struct main_node*);
+    return 0;
+}
+
+/*
+ * Maps num_of_pages new pages and appends a main_node for them at the end
+ * of the main chain. The caller fills in the segment list.
+ * @param num_of_pages The number of pages to map.
+ * @param mmap_flags Flags passed to mmap in addition to MAP_PRIVATE | MAP_ANONYMOUS.
+ * @return The new main_node, or NULL if mmap failed.
+ */
+struct main_node* map_main_node(int num_of_pages, int mmap_flags) {
+    void* p_addr = mmap(NULL, (size_t)num_of_pages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | mmap_flags, -1, 0);
+    if (p_addr == MAP_FAILED) {
+        perror("mmap failed on mems_malloc");
+        return NULL;
+    }
+
+    if (mems_opt_tagged_vaddr && reserve_main_slots(main_slots_len + 1) != 0) {
+        munmap(p_addr, (size_t)num_of_pages * PAGE_SIZE);
+        return NULL;
+    }
+
+    struct main_node* tail = head_main->prev;
+    struct main_node* new_main_node = add_main_node();
+    new_main_node->p_addr = p_addr;
+    new_main_node->num_of_pages = num_of_pages;
+    if (mems_opt_tagged_vaddr) {
+        new_main_node->v_addr_start = (void*)((uintptr_t)(main_slots_len + 1) << TAG_SHIFT);
+        main_slots[main_slots_len++] = new_main_node;
+    } else {
+        new_main_node->v_addr_start = tail->v_addr_end + 1;
+    }
+    new_main_node->v_addr_end = new_main_node->v_addr_start + ((size_t)num_of_pages * PAGE_SIZE) - 1;
+    new_main_node->next = head_main;
+    new_main_node->prev = tail;
+    new_main_node->sub_head = NULL;
+    new_main_node->flags = 0;
+    new_main_node->checkpoint_hash = 0;
+    mapped_pages += num_of_pages;
+    if (mapped_pages > peak_pages) {
+        peak_pages = mapped_pages;
+    }
+    flight_path = FLIGHT_PATH_MAP;
+    tail->next = new_main_node;
+    head_main->prev = new_main_node;
+    return new_main_node;
+}
+
+/*
+* Lifetime profiler. With opt.lifetime_sample set to N, one in N
+* allocations is stamped with its allocation time and call site. When it is
+* freed, its lifetime is added to a log2 histogram of its call site and of
+* its size bucket. mems_lifetime_report() prints both, together with the
+* ages of the sampled objects that are still live.
+*/
+#define LIFETIME_BUCKETS 48 // Bucket b holds lifetimes in [2^b, 2^(b+1)) ns
+#define LIFETIME_SITES 256
+// The allocation functions that stamp call sites are kept out of line so
+// that __builtin_return_address(0) names their caller.
+
+struct lifetime_site {
+    void* pc;                // Return address into the caller, NULL for an unused entry
+    size_t freed[LIFETIME_BUCKETS];
+};
+
+struct lifetime_site lifetime_sites[LIFETIME_SITES];
+size_t lifetime_by_size[SIZE_BUCKETS][LIFETIME_BUCKETS];
+size_t lifetime_countdown = 0;
+
+int lifetime_bucket(uint64_t ns) {
+    int bucket = 0;
+    while (bucket < LIFETIME_BUCKETS - 1 && ((uint64_t)2 << bucket) <= ns) {
+        bucket++;
+    }
+    return bucket;
+}
+
+// Finds or adds the entry of a call site; the last entry collects sites that do not fit
+int lifetime_site_index(void* pc) {
+    size_t start = ((uintptr_t)pc >> 4) % (LIFETIME_SITES - 1);
+    for (size_t i = 0; i < LIFETIME_SITES - 1; i++) {
+        size_t index = (start + i) % (LIFETIME_SITES - 1);
+        if (lifetime_sites[index].pc == pc) {
+            return (int)index;
+        }
+        if (lifetime_sites[index].pc == NULL) {
+            lifetime_sites[index].pc = pc;
+            return (int)index;
+        }
+    }
+    return LIFETIME_SITES - 1;
+}
+
+/*
+ * Counts an allocation returned by a public allocation function and stamps
+ * every opt.lifetime_sample-th one. The caller holds mems_lock.
+ */
+void lifetime_tick(void* v_ptr, void* pc) {
+    if (v_ptr == NULL || mems_opt_lifetime_sample == 0) {
+        return;
+    }
+    if (lifetime_countdown == 0 || lifetime_countdown > mems_opt_lifetime_sample) {
+        lifetime_countdown = mems_opt_lifetime_sample;
+    }
+    if (--lifetime_countdown != 0) {
+        return;
+    }
+    struct main_node* node = find_main_node(v_ptr);
+    for (struct sub_node* sub = node != NULL ? node->sub_head : NULL; sub != NULL; sub = sub->next) {
+        if (sub->v_addr_start == v_ptr) {
+            sub->birth = monotonic_ns();
+            sub->site = lifetime_site_index(pc);
+            lifetime_sampled++;
+            return;
+        }
+    }
+}
+
+// Records the lifetime of a sampled segment that is being freed
+void lifetime_record(struct sub_node* sub) {
+    int bucket = lifetime_bucket(monotonic_ns() - sub->birth);
+    lifetime_sites[sub->site].freed[bucket]++;
+    lifetime_by_size[size_bucket(sub->size)][bucket]++;
+    lifetime_freed++;
+    sub->birth = 0;
+}
+
+// Prints a duration given in ns with a readable unit
+void print_duration(FILE* out, double ns) {
+    if (ns < 1e3) {
+        fprintf(out, " %7.0fns", ns);
+    } else if (ns < 1e6) {
+        fprintf(out, " %7.1fus", ns / 1e3);
+    } else if (ns < 1e9) {
+        fprintf(out, " %7.1fms", ns / 1e6);
+    } else {
+        fprintf(out, " %7.1fs ", ns / 1e9);
+    }
+}
+
+// Prints the count and the upper bounds of the buckets holding the 50th and 90th percentiles and the maximum
+void print_lifetime_row(FILE* out, const size_t* histogram, size_t live) {
+    size_t total = 0;
+    int max = -1;
+    for (int b = 0; b < LIFETIME_BUCKETS; b++) {
+        total += histogram[b];
+        if (histogram[b] != 0) {
+            max = b;
+        }
+    }
+    fprintf(out, " %10zu %8zu", total, live);
+    size_t seen = 0;
+    int p50 = -1;
+    int p90 = -1;
+    for (int b = 0; b < LIFETIME_BUCKETS && total != 0; b++) {
+        seen += histogram[b];
+        if (p50 < 0 && seen * 2 >= total) {
+            p50 = b;
+        }
+        if (p90 < 0 && seen * 10 >= total * 9) {
+            p90 = b;
+        }
+    }
+    int buckets[3] = {p50, p90, max};
+    for (int i = 0; i < 3; i++) {
+        if (buckets[i] < 0) {
+            fprintf(out, " %9s", "-");
+        } else {
+            print_duration(out, (double)((uint64_t)2 << buckets[i]));
+        }
+    }
+    fprintf(out, "\n");
+}
+
+// Forgets every site and histogram, called once a run's profile has been reported
+void lifetime_reset() {
+    memset(lifetime_sites, 0, sizeof(lifetime_sites));
+    memset(lifetime_by_size, 0, sizeof(lifetime_by_size));
+    lifetime_sampled = 0;
+    lifetime_freed = 0;
+    lifetime_countdown = 0;
+}
+
+/*
+ * Prints the lifetime histograms gathered so far, per call site and per
+ * size bucket: the number of sampled objects freed, the sampled objects
+ * still live, and the 50th/90th percentile and maximum lifetime (as
+ * power-of-two upper bounds). Call sites are return addresses, which
+ * addr2line maps back to source lines.
+ * @param out The stream to print to.
+ */
+void mems_lifetime_report(FILE* out) {
+    pthread_mutex_lock(&mems_lock);
+    size_t live_by_site[LIFETIME_SITES] = {0};
+    size_t live_by_size[SIZE_BUCKETS] = {0};
+    for (struct main_node* node = head_main->next; node != head_main; node = node->next) {
+        for (struct sub_node* sub = node->sub_head; sub != NULL; sub = sub->next) {
+            if (sub->type == PROCESS && sub->birth != 0) {
+                live_by_site[sub->site]++;
+                live_by_size[size_bucket(sub->size)]++;
+            }
+        }
+    }
+
+    fprintf(out, "\n--- MeMS Lifetime Profile (1 in %zu sampled, %zu sampled, %zu freed) ---\n",
+            mems_opt_lifetime_sample, lifetime_sampled, lifetime_freed);
+    fprintf(out, "%-20s %10s %8s %9s %9s %9s\n", "site", "freed", "live", "p50", "p90", "max");
+    for (int i = 0; i < LIFETIME_SITES; i++) {
+        if (lifetime_sites[i].pc == NULL && !(i == LIFETIME_SITES - 1 && live_by_site[i] != 0)) {
+            continue;
+        }
+        if (i == LIFETIME_SITES - 1) {
+            fprintf(out, "%-20s", "(other sites)");
+        } else {
+            fprintf(out, "%-20p", lifetime_sites[i].pc);
+        }
+        print_lifetime_row(out, lifetime_sites[i].freed, live_by_site[i]);
+    }
+    fprintf(out, "%-20s %10s %8s %9s %9s %9s\n", "size", "freed", "live", "p50", "p90", "max");
+    for (int b = 0; b < SIZE_BUCKETS; b++) {
+        size_t freed = 0;
+        for (int l = 0; l < LIFETIME_BUCKETS; l++) {
+            freed += lifetime_by_size[b][l];
+        }
+        if (freed == 0 && live_by_size[b] == 0) {
+            continue;
+        }
+        char range[32];
+        snprintf(range, sizeof(range), "[%zu, %zu)", (size_t)1 << b, (size_t)2 << b);
+        fprintf(out, "%-20s", range);
+        print_lifetime_row(out, lifetime_by_size[b], live_by_size[b]);
+    }
+    fprintf(out, "-------------------------\n");
+    pthread_mutex_unlock(&mems_lock);
+}
+
+/*
+ * Splits a segment in two at offset bytes from its start. The second part
+ * gets the same type and flags.
+ * @return The second part.
+ */
+struct sub_node* split_sub_node(struct sub_node* sub, size_t offset) {
+    struct sub_node* rest = add_sub_node();
+    rest->type = sub->type;
+    rest->flags = sub->flags;
+    rest->size = sub->size - (int)offset;
+    rest->p_addr = (char*)sub->p_addr + offset;
+    rest->v_addr_start = (char*)sub->v_addr_start + offset;
+    rest->v_addr_end = sub->v_addr_end;
+    rest->next = sub->next;
+    rest->prev = sub;
+    if (sub->next != NULL) {
+        sub->next->prev = rest;
+    }
+    sub->next = rest;
+    sub->size = (int)offset;
+    sub->v_addr_end = (char*)sub->v_addr_start + offset - 1;
+    return rest;
+}
+
+/*
+ * Allocates size bytes from a hole of at least that size. The hole is split
+ * if more than mems_opt_split_threshold bytes would be left over, keeping
+ * the allocation at its start or, with at_end, at its end.
+ * @return The new PROCESS segment.
+ */
+struct sub_node* take_from_hole(struct sub_node* hole, size_t size, int at_end) {
+    struct sub_node* taken = hole;
+    if (hole->size > size + mems_opt_split_threshold) {
+        struct sub_node* rest = split_sub_node(hole, at_end ? hole->size - size : size);
+        taken = at_end ? rest : hole;
+    }
+    taken->type = PROCESS;
+    taken->flags &= ~SUB_PURGED;
+    flight_path = FLIGHT_PATH_HOLE;
+    return taken;
+}
+
+// mems_malloc() for callers already holding mems_lock
+void* mems_malloc_unlocked(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    malloc_size_histogram[size_bucket(size)]++;
+    if (mems_opt_adaptive) {
+        adaptive_record_malloc(size);
+    }
+
+    struct main_node* current_main_node = head_main->next;
+    // Search for a suitable hole in existing pages
+    while (current_main_node != head_main) {
+        struct sub_node* current_sub_node = current_main_node->sub_head;
+        while (current_sub_node != NULL) {
+            if (current_sub_node->type == HOLE && current_sub_node->size >= size) {
+                return take_from_hole(current_sub_node, size, 0)->v_addr_start;
+            }
+            current_sub_node = current_sub_node->next;
+        }
+        current_main_node = current_main_node->next;
+    }
+
+    // No suitable hole found, allocate new page(s)
+    if (mems_opt_adaptive) {
+        adaptive_window.mappings++;
+    }
+    int num_of_pages = ceil((double)size * mems_opt_growth_factor / (double)PAGE_SIZE);
+    struct main_node* new_main_node = map_main_node(num_of_pages, 0);
+    if (new_main_node == NULL) {
+        return NULL;
+    }
+    void* p_addr = new_main_node->p_addr;
+
+    struct sub_node* new_sub_node = add_sub_node();
+    new_sub_node->type = PROCESS;
+    new_sub_node->size = (int)size;
+    new_sub_node->p_addr = p_addr;
+    new_sub_node->v_addr_start = new_main_node->v_addr_start;
+    new_sub_node->v_addr_end = (void*)(new_sub_node->v_addr_start + size - 1);
+    new_sub_node->next = NULL;
+    new_sub_node->prev = NULL;
+
+    // Create a new hole for the remaining space
+    if (size < num_of_pages * PAGE_SIZE) {
+        struct sub_node* new_hole = add_sub_node();
+        new_hole->type = HOLE;
+        new_hole->size = num_of_pages * PAGE_SIZE - (int)size;
+        new_hole->p_addr = (void*)(p_addr + size);
+        new_hole->v_addr_start = (void*)(new_sub_node->v_addr_start + size);
+        new_hole->v_addr_end = new_main_node->v_addr_end;
+        new_hole->next = NULL;
+        new_hole->prev = new_sub_node;
+        new_sub_node->next = new_hole;
+    }
+    
+    new_main_node->sub_head = new_sub_node;
+    return new_sub_node->v_addr_start;
+}
+
+/*
+ * Allocates a memory segment of a specified size.
+ * It attempts to find a suitable hole in the free list. If none is found,
+ * it requests more memory from the OS using mmap.
+ * @param size The number of bytes to allocate.
+ * @return A MeMS virtual address to the start of the allocated segment, or NULL on failure.
+ */
+__attribute__((noinline)) void* mems_malloc(size_t size) {
+    uint64_t start = flight_start();
+    pthread_mutex_lock(&mems_lock);
+    void* v_ptr = mems_malloc_unlocked(size);
+    lifetime_tick(v_ptr, __builtin_return_address(0));
+    pthread_mutex_unlock(&mems_lock);
+    flight_record(FLIGHT_MALLOC, size, v_ptr, start);
+    return v_ptr;
+}
+
+// mems_malloc_near() for callers already holding mems_lock
+void* mems_malloc_near_unlocked(size_t size, void* hint) {
+    struct main_node* node = find_main_node(hint);
+    if (size == 0 || node == NULL || (node->flags & MAIN_LOCKED)) {
+        return mems_malloc_unlocked(size);
+    }
+
+    // The hole closest to the hint, allocating from its near end
+    struct sub_node* best = NULL;
+    size_t best_distance = SIZE_MAX;
+    int best_at_end = 0;
+    for (struct sub_node* sub = node->sub_head; sub != NULL; sub = sub->next) {
+        if (sub->type != HOLE || (size_t)sub->size < size) {
+            continue;
+        }
+        int at_end = sub->v_addr_end < hint;
+        size_t distance = at_end ? (char*)hint - (char*)sub->v_addr_end : (char*)sub->v_addr_start > (char*)hint ?
+                                   (char*)sub->v_addr_start - (char*)hint : 0;
+        if (distance < best_distance) {
+            best = sub;
+            best_distance = distance;
+            best_at_end = at_end;
+        }
+    }
+    if (best == NULL) {
+        return mems_malloc_unlocked(size);
+    }
+    malloc_size_histogram[size_bucket(size)]++;
+    if (mems_opt_adaptive) {
+        adaptive_record_malloc(size);
+    }
+    return take_from_hole(best, size, best_at_end)->v_addr_start;
+}
+
+/*
+ * Allocates a segment close to an existing one. The hole of the hint's
+ * main_node nearest to the hint is used, taking the allocation from the
+ * end of a hole before the hint and from the start of one after it, so
+ * linked structures stay on the same pages. If the main_node has no large
+ * enough hole, this behaves like mems_malloc().
+ * @param size The number of bytes to allocate.
+ * @param hint A MeMS virtual address, usually of a segment the new one
+ *             will be accessed together with.
+ * @return A MeMS virtual address to the start of the allocated segment, or NULL on failure.
+ */
+__attribute__((noinline)) void* mems_malloc_near(size_t size, void* hint) {
+    uint64_t start = flight_start();
+    pthread_mutex_lock(&mems_lock);
+    void* v_ptr = mems_malloc_near_unlocked(size, hint);
+    lifetime_tick(v_ptr, __builtin_return_address(0));
+    pthread_mutex_unlock(&mems_lock);
+    flight_record(FLIGHT_MALLOC_NEAR, size, v_ptr, start);
+    return v_ptr;
+}
+
+// mems_malloc_isolated() for callers already holding mems_lock
+void* mems_malloc_isolated_unlocked(size_t size) {
+    if (size == 0 || size > INT32_MAX) {
+        return NULL;
+    }
+    size_t line = 1;
+    while (line < mems_opt_isolation_line) {
+        line *= 2;
+    }
+    size_t padded = (size + line - 1) & ~(line - 1);
+
+    // First hole with room for the padded size at a line boundary
+    struct sub_node* hole = NULL;
+    size_t lead = 0;
+    for (struct main_node* node = head_main->next; node != head_main && hole == NULL; node = node->next) {
+        for (struct sub_node* sub = node->sub_head; sub != NULL; sub = sub->next) {
+            if (sub->type != HOLE) {
+                continue;
+            }
+            lead = (line - ((uintptr_t)sub->p_addr & (line - 1))) & (line - 1);
+            if (lead + padded <= (size_t)sub->size) {
+                hole = sub;
+                break;
+            }
+        }
+    }
+    if (hole == NULL) {
+        int num_of_pages = ceil((double)padded * mems_opt_growth_factor / (double)PAGE_SIZE);
+        struct main_node* node = map_main_node(num_of_pages, 0);
+        if (node == NULL) {
+            return NULL;
+        }
+        hole = add_sub_node();
+        hole->type = HOLE;
+        hole->size = num_of_pages * PAGE_SIZE;
+        hole->p_addr = node->p_addr;
+        hole->v_addr_start = node->v_addr_start;
+        hole->v_addr_end = node->v_addr_end;
+        hole->next = NULL;
+        hole->prev = NULL;
+        node->sub_head = hole;
+        lead = 0;
+    } else {
+        flight_path = FLIGHT_PATH_HOLE;
+    }
+
+    // The space before and after the padded segment starts and ends on line
+    // boundaries, so it stays an ordinary hole
+    if (lead != 0) {
+        hole = split_sub_node(hole, lead);
+    }
+    if ((size_t)hole->size > padded) {
+        split_sub_node(hole, padded);
+    }
+    if (padded > size) {
+        struct sub_node* pad = split_sub_node(hole, size);
+        pad->type = PAD;
+        pad->flags &= ~SUB_PURGED;
+    }
+    hole->type = PROCESS;
+    hole->flags &= ~SUB_PURGED;
+    malloc_size_histogram[size_bucket(size)]++;
+    return hole->v_addr_start;
+}
+
+/*
+ * Allocates a segment that owns its cache lines exclusively, to keep data
+ * written by different threads from sharing a line. The segment starts on
+ * a opt.isolation_line boundary (64 bytes by default, 128 for adjacent-line
+ * prefetchers), and the rest of its last line is held by a PAD segment that
+ * is never handed out and is released by mems_free(). The padding in use
+ * is reported as padding_bytes by mems_get_stats() and by
+ * mems_print_stats().
+ * @param size The number of bytes to allocate.
+ * @return A MeMS virtual address to the start of the allocated segment, or NULL on failure.
+ */
+__attribute__((noinline)) void* mems_malloc_isolated(size_t size) {
+    uint64_t start = flight_start();
+    pthread_mutex_lock(&mems_lock);
+    void* v_ptr = mems_malloc_isolated_unlocked(size);
+    lifetime_tick(v_ptr, __builtin_return_address(0));
+    pthread_mutex_unlock(&mems_lock);
+    flight_record(FLIGHT_MALLOC_ISOLATED, size, v_ptr, start);
+    return v_ptr;
+}
+
+// mems_print_stats() for callers already holding mems_lock
+void mems_print_stats_unlocked() {
+    if (head_main->next == head_main) {
+        printf("MeMS Status: No pages allocated.\n");
+        return;
+    }
+
+    struct main_node* current_main_node = head_main->next;
+    int total_pages = 0;
+    int total_unused_size = 0;
+    int total_padding = 0;
+    int main_chain_len = 0;
+    printf("\n--- MeMS System Stats ---\n");
+    while (current_main_node != head_main) {
+        total_pages += current_main_node->num_of_pages;
+        printf("MAIN[%lu:%lu]%s-> ", (uintptr_t)current_main_node->v_addr_start, (uintptr_t)current_main_node->v_addr_end,
+               current_main_node->flags & MAIN_LOCKED ? "(locked)" : "");
+        main_chain_len++;
+        struct sub_node* current_sub_node = current_main_node->sub_head;
+        while (current_sub_node != NULL) {
+            if (current_sub_node->type == HOLE) {
+                printf("H[%lu:%lu](%d) <-> ", (uintptr_t)current_sub_node->v_addr_start, (uintptr_t)current_sub_node->v_addr_end, current_sub_node->size);
+                total_unused_size += current_sub_node->size;
+            } else if (current_sub_node->type == PAD) {
+                printf("X[%lu:%lu](%d) <-> ", (uintptr_t)current_sub_node->v_addr_start, (uintptr_t)current_sub_node->v_addr_end, current_sub_node->size);
+                total_padding += current_sub_node->size;
+            } else {
+                printf("P[%lu:%lu](%d) <-> ", (uintptr_t)current_sub_node->v_addr_start, (uintptr_t)current_sub_node->v_addr_end, current_sub_node->size);
+            }
+            current_sub_node = current_sub_node->next;
+        }
+        current_main_node = current_main_node->next;
+        printf("NULL\n");
+    }
+    printf("Pages used: %d\n", total_pages);
+    printf("Space unused: %d bytes\n", total_unused_size);
+    printf("Main chain length: %d\n", main_chain_len);
+    if (total_padding != 0) {
+        printf("Isolation padding: %d bytes\n", total_padding);
+    }
+    if (tune_decisions_total != 0) {
+        printf("Adaptive decisions: %zu over %zu passes\n", tune_decisions_total, adaptive_passes);
+        size_t first = tune_decisions_total > TUNE_LOG_SIZE ? tune_decisions_total - TUNE_LOG_SIZE : 0;
+        for (size_t i = first; i < tune_decisions_total; i++) {
+            struct tune_decision* decision = &tune_log[i % TUNE_LOG_SIZE];
+            printf("  pass %zu: %s %g -> %g (%s)\n", decision->pass, decision->param,
+                   decision->old_value, decision->new_value, decision->reason);
+        }
+    }
+    printf("-------------------------\n");
+}
+
+/*
+ * Prints statistics about the current state of the MeMS system,
+ * including page usage, fragmentation, and memory layout.
+ */
+void mems_print_stats() {
+    pthread_mutex_lock(&mems_lock);
+    mems_print_stats_unlocked();
+    pthread_mutex_unlock(&mems_lock);
+}
+
+// mems_get() for callers already holding mems_lock
+void* mems_get_unlocked(void* v_ptr) {
+    struct main_node* main_node = find_main_node(v_ptr);
+    if (main_node == NULL) {
+        return NULL; // Address not found in any managed segment
+    }
+    struct sub_node* current_sub_node = main_node->sub_head;
+    while (current_sub_node != NULL) {
+        if (v_ptr >= current_sub_node->v_addr_start && v_ptr <= current_sub_node->v_addr_end) {
+            if (current_sub_node->type == PROCESS) {
+                return current_sub_node->p_addr + ((char*)v_ptr - (char*)current_sub_node->v_addr_start);
+            } else {
+                return NULL; // Address points to a hole
+            }
+        }
+        current_sub_node = current_sub_node->next;
+    }
+    return NULL;
+}
+
+/*
+ * Translates a MeMS virtual address to its corresponding physical address.
+ * @param v_ptr The MeMS virtual address to translate.
+ * @return The corresponding physical address, or NULL if the address is invalid.
+ */
+void* mems_get(void* v_ptr) {
+    pthread_mutex_lock(&mems_lock);
+    void* p_addr = mems_get_unlocked(v_ptr);
+    pthread_mutex_unlock(&mems_lock);
+    return p_addr;
+}
+
+// A PROCESS segment as seen through mems_get_segment()
+struct mems_segment {
+    void* v_addr_start;
+    void* v_addr_end;
+    void* p_addr;
+};
+
+// mems_get_segment() for callers already holding mems_lock
+int mems_get_segment_unlocked(void* v_ptr, struct mems_segment* segment) {
+    struct main_node* main_node = find_main_node(v_ptr);
+    if (main_node == NULL) {
+        return -1;
+    }
+    struct sub_node* current_sub_node = main_node->sub_head;
+    while (current_sub_node != NULL) {
+        if (v_ptr >= current_sub_node->v_addr_start && v_ptr <= current_sub_node->v_addr_end) {
+            if (current_sub_node->type != PROCESS) {
+                return -1;
+            }
+            segment->v_addr_start = current_sub_node->v_addr_start;
+            segment->v_addr_end = current_sub_node->v_addr_end;
+            segment->p_addr = current_sub_node->p_addr;
+            return 0;
+        }
+        current_sub_node = current_sub_node->next;
+    }
+    return -1;
+}
+
+/*
+ * Looks up the allocated segment containing a MeMS virtual address.
+ * Unlike mems_get(), this also reports the segment bounds, so callers can
+ * translate any address inside the segment without another lookup for as
+ * long as mems_epoch does not change.
+ * @param v_ptr A MeMS virtual address inside the segment.
+ * @param segment Receives the segment's virtual bounds and physical start.
+ * @return 0 on success, -1 if the address is not inside an allocated segment.
+ */
+int mems_get_segment(void* v_ptr, struct mems_segment* segment) {
+    pthread_mutex_lock(&mems_lock);
+    int ret = mems_get_segment_unlocked(v_ptr, segment);
+    pthread_mutex_unlock(&mems_lock);
+    return ret;
+}
+
+void merge_holes() {
+    struct main_node* current_main_node = head_main->next;
+    while (current_main_node != head_main) {
+        struct sub_node* current_sub_node = current_main_node->sub_head;
+        while (current_sub_node != NULL) {
+            if (current_sub_node->type == HOLE && current_sub_node->next != NULL && current_sub_node->next->type == HOLE) {
+                struct sub_node* next_hole = current_sub_node->next;
+                current_sub_node->size += next_hole->size;
+                current_sub_node->v_addr_end = next_hole->v_addr_end;
+                current_sub_node->flags &= next_hole->flags;
+                current_sub_node->next = next_hole->next;
+                if (next_hole->next != NULL) {
+                    next_hole->next->prev = current_sub_node;
+                }
+                release_sub_node(next_hole);
+                continue; // Re-check the current node in case it can merge again
+            }
+            current_sub_node = current_sub_node->next;
+        }
+        current_main_node = current_main_node->next;
+    }
+}
+
+// mems_free() for callers already holding mems_lock
+void mems_free_unlocked(void* v_ptr) {
+    if(v_ptr == NULL) return;
+    uint64_t start_ns = mems_opt_adaptive ? monotonic_ns() : 0;
+
+    struct main_node* main_node = find_main_node(v_ptr);
+    if (main_node == NULL || (main_node->flags & MAIN_LOCKED)) {
+        return;
+    }
+    struct sub_node* current_sub_node = main_node->sub_head;
+    while (current_sub_node != NULL) {
+        if (current_sub_node->v_addr_start == v_ptr && current_sub_node->type == PROCESS) {
+            if (current_sub_node->birth != 0) {
+                lifetime_record(current_sub_node);
+            }
+            current_sub_node->type = HOLE;
+            if (current_sub_node->next != NULL && current_sub_node->next->type == PAD) {
+                current_sub_node->next->type = HOLE;
+            }
+            mems_epoch++;
+            merge_holes();
+            if (mems_opt_purge_decay != 0 && ++frees_since_purge >= mems_opt_purge_decay) {
+                purge_holes();
+                frees_since_purge = 0;
+            }
+            if (mems_opt_rss_target != 0 && ++frees_since_rss_step >= mems_opt_rss_interval) {
+                rss_pace();
+            }
+            if (mems_opt_adaptive) {
+                adaptive_window.frees++;
+                adaptive_window.free_ns += monotonic_ns() - start_ns;
+                adaptive_tick();
+            }
+            return;
+        }
+        current_sub_node = current_sub_node->next;
+    }
+}
+
+/*
+ * Frees a previously allocated memory segment.
+ * The freed segment is marked as a HOLE and merged with adjacent holes.
+ * @param v_ptr The MeMS virtual address of the segment to free.
+ */
+void mems_free(void* v_ptr) {
+    uint64_t start = flight_start();
+    pthread_mutex_lock(&mems_lock);
+    mems_free_unlocked(v_ptr);
+    pthread_mutex_unlock(&mems_lock);
+    flight_record(FLIGHT_FREE, 0, v_ptr, start);
+}
+
+/*
+ * Highest MeMS virtual address a main_node may grow to without overlapping
+ * the next one or, with tagged addresses, leaving its slot.
+ */
+void* main_node_v_limit(struct main_node* node) {
+    if (mems_opt_tagged_vaddr) {
+        return (void*)((uintptr_t)node->v_addr_start | TAG_OFFSET_MASK);
+    }
+    if (node->next == head_main) {
+        return (void*)UINTPTR_MAX;
+    }
+    return node->next->v_addr_start - 1;
+}
+
+// mems_extend() for callers already holding mems_lock
+int mems_extend_unlocked(void* v_ptr, size_t size) {
+    struct main_node* current_main_node = find_main_node(v_ptr);
+    struct sub_node* segment = NULL;
+    if (current_main_node != NULL) {
+        for (struct sub_node* sub = current_main_node->sub_head; sub != NULL; sub = sub->next) {
+            if (sub->v_addr_start == v_ptr && sub->type == PROCESS) {
+                segment = sub;
+                break;
+            }
+        }
+    }
+    if (segment == NULL || size > INT32_MAX || (current_main_node->flags & MAIN_LOCKED)) {
+        return -1;
+    }
+    if (size <= (size_t)segment->size) {
+        return 0;
+    }
+
+    size_t needed = size - segment->size;
+    struct sub_node* next = segment->next;
+    if (next != NULL && next->type == HOLE && (size_t)next->size >= needed) {
+        if ((size_t)next->size > needed + mems_opt_split_threshold) {
+            next->size -= (int)needed;
+            next->p_addr = next->p_addr + needed;
+            next->v_addr_start = next->v_addr_start + needed;
+            segment->size = (int)size;
+        } else {
+            // Too little would be left over to be useful, absorb the whole hole
+            segment->size += next->size;
+            segment->next = next->next;
+            if (next->next != NULL) {
+                next->next->prev = segment;
+            }
+            release_sub_node(next);
+        }
+        segment->v_addr_end = segment->v_addr_start + segment->size - 1;
+        flight_path = FLIGHT_PATH_IN_PLACE;
+        return 0;
+    }
+
+    // Grow the whole mapping when nothing but a hole follows the segment
+    if (size < mems_opt_mremap_threshold || (next != NULL && (next->type != HOLE || next->next != NULL))) {
+        return -1;
+    }
+    size_t offset = (char*)segment->v_addr_start - (char*)current_main_node->v_addr_start;
+    size_t old_pages = current_main_node->num_of_pages;
+    size_t new_pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (new_pages * PAGE_SIZE > INT32_MAX ||
+        (uintptr_t)current_main_node->v_addr_start + new_pages * PAGE_SIZE - 1 > (uintptr_t)main_node_v_limit(current_main_node)) {
+        return -1;
+    }
+    void* p_addr = mremap(current_main_node->p_addr, old_pages * PAGE_SIZE, new_pages * PAGE_SIZE, MREMAP_MAYMOVE);
+    if (p_addr == MAP_FAILED) {
+        return -1;
+    }
+    if (p_addr != current_main_node->p_addr) {
+        for (struct sub_node* sub = current_main_node->sub_head; sub != NULL; sub = sub->next) {
+            sub->p_addr = (char*)p_addr + ((char*)sub->p_addr - (char*)current_main_node->p_addr);
+        }
+        current_main_node->p_addr = p_addr;
+        mems_epoch++;
+    }
+    current_main_node->num_of_pages = (int)new_pages;
+    mapped_pages += new_pages - old_pages;
+    if (mapped_pages > peak_pages) {
+        peak_pages = mapped_pages;
+    }
+    current_main_node->v_addr_end = current_main_node->v_addr_start + new_pages * PAGE_SIZE - 1;
+
+    if (next != NULL) {
+        segment->next = NULL;
+        release_sub_node(next);
+    }
+    segment->size = (int)size;
+    segment->v_addr_end = segment->v_addr_start + size - 1;
+    if (offset + size < new_pages * PAGE_SIZE) {
+        struct sub_node* new_hole = add_sub_node();
+        new_hole->type = HOLE;
+        new_hole->size = (int)(new_pages * PAGE_SIZE - offset - size);
+        new_hole->p_addr = segment->p_addr + size;
+        new_hole->v_addr_start = segment->v_addr_end + 1;
+        new_hole->v_addr_end = current_main_node->v_addr_end;
+        new_hole->next = NULL;
+        new_hole->prev = segment;
+        segment->next = new_hole;
+    }
+    flight_path = FLIGHT_PATH_REMAP;
+    return 0;
+}
+
+/*
+ * Grows an allocated segment without moving its MeMS virtual address.
+ * If the following segment is a hole large enough, the segment takes the
+ * space from it. Otherwise, a segment of at least mems_opt_mremap_threshold
+ * bytes that ends its main_node is grown by mremap, which may move the
+ * physical pages (bumping mems_epoch) but keeps every virtual address.
+ * @param v_ptr The MeMS virtual address returned by mems_malloc.
+ * @param size The new minimum size in bytes.
+ * @return 0 if the segment now holds at least size bytes, -1 otherwise.
+ */
+int mems_extend(void* v_ptr, size_t size) {
+    uint64_t start = flight_start();
+    pthread_mutex_lock(&mems_lock);
+    int ret = mems_extend_unlocked(v_ptr, size);
+    pthread_mutex_unlock(&mems_lock);
+    flight_record(FLIGHT_EXTEND, size, ret == 0 ? v_ptr : NULL, start);
+    return ret;
+}
+
+// mems_realloc() for callers already holding mems_lock
+void* mems_realloc_unlocked(void* v_ptr, size_t size) {
+    if (v_ptr == NULL) {
+        return mems_malloc_unlocked(size);
+    }
+    struct mems_segment old_segment;
+    if (mems_get_segment_unlocked(v_ptr, &old_segment) != 0 || old_segment.v_addr_start != v_ptr) {
+        return NULL;
+    }
+    if (mems_extend_unlocked(v_ptr, size) == 0) {
+        return v_ptr;
+    }
+
+    void* new_v_ptr = mems_malloc_unlocked(size);
+    if (new_v_ptr == NULL) {
+        return NULL;
+    }
+    // The old segment's physical address may be stale if mems_extend moved pages
+    mems_get_segment_unlocked(v_ptr, &old_segment);
+    size_t old_size = (char*)old_segment.v_addr_end - (char*)old_segment.v_addr_start + 1;
+    memcpy(mems_get_unlocked(new_v_ptr), old_segment.p_addr, old_size < size ? old_size : size);
+    mems_free_unlocked(v_ptr);
+    flight_path = FLIGHT_PATH_MOVE;
+    return new_v_ptr;
+}
+
+/*
+ * Resizes an allocated segment, growing it in place with mems_extend()
+ * when possible and otherwise copying it into a new segment.
+ * @param v_ptr The MeMS virtual address of the segment, or NULL to allocate.
+ * @param size The new size in bytes.
+ * @return The MeMS virtual address of the resized segment, which only differs
+ *         from v_ptr if the contents had to be copied, or NULL on failure.
+ */
+void* mems_realloc(void* v_ptr, size_t size) {
+    uint64_t start = flight_start();
+    pthread_mutex_lock(&mems_lock);
+    void* new_v_ptr = mems_realloc_unlocked(v_ptr, size);
+    pthread_mutex_unlock(&mems_lock);
+    flight_record(FLIGHT_REALLOC, size, new_v_ptr, start);
+    return new_v_ptr;
+}
+
+/*
+* Thread cache. Small objects handed out by mems_tcache_alloc() are carved
+* from slabs obtained with mems_malloc and kept in per-thread bins, so the
+* common path takes no lock. Full bins spill half their objects to a shared
+* depot, and empty bins refill from it before carving a new slab.
+* Unlike mems_malloc, these objects are addressed by physical pointers.
+*/
+#define TCACHE_CLASSES 12
+#define TCACHE_MAX_SIZE 4096
+#define TCACHE_SLAB_SIZE (16 * PAGE_SIZE)
+#define TCACHE_ALIGN 64
+
+size_t tcache_class_sizes[TCACHE_CLASSES] = {64, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096};
+
+// A LIFO list of free objects, linked through their first word
+struct tcache_bin {
+    void* head;
+    size_t count;
+};
+
+struct tcache {
+    struct tcache_bin bins[TCACHE_CLASSES];
+    uint64_t generation;
+};
+
+__thread struct tcache thread_cache;
+
+struct tcache_bin tcache_depot[TCACHE_CLASSES];
+uint64_t tcache_depot_generation = 0;
+pthread_mutex_t tcache_depot_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t tcache_class_slabs[TCACHE_CLASSES]; // Slabs carved per size class
+size_t tcache_next_color[TCACHE_CLASSES];  // Color of the next slab of each class, under mems_lock
+
+int tcache_class(size_t size) {
+    for (int i = 0; i < TCACHE_CLASSES; i++) {
+        if (size <= tcache_class_sizes[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns the calling thread's cache, emptied if the heap was reset since its last use
+struct tcache* current_tcache() {
+    uint64_t generation = __atomic_load_n(&tcache_generation, __ATOMIC_ACQUIRE);
+    if (thread_cache.generation != generation) {
+        memset(thread_cache.bins, 0, sizeof(thread_cache.bins));
+        thread_cache.generation = generation;
+    }
+    return &thread_cache;
+}
+
+// Moves up to count objects from one bin to another
+void tcache_move(struct tcache_bin* from, struct tcache_bin* to, size_t count) {
+    while (count-- > 0 && from->head != NULL) {
+        void* object = from->head;
+        from->head = *(void**)object;
+        from->count--;
+        *(void**)object = to->head;
+        to->head = object;
+        to->count++;
+    }
+}
+
+// The caller holds tcache_depot_lock
+struct tcache_bin* depot_bin(int cls) {
+    uint64_t generation = __atomic_load_n(&tcache_generation, __ATOMIC_ACQUIRE);
+    if (tcache_depot_generation != generation) {
+        memset(tcache_depot, 0, sizeof(tcache_depot));
+        tcache_depot_generation = generation;
+    }
+    return &tcache_depot[cls];
+}
+
+void tcache_spill(struct tcache_bin* bin, int cls, size_t count) {
+    pthread_mutex_lock(&tcache_depot_lock);
+    tcache_move(bin, depot_bin(cls), count);
+    pthread_mutex_unlock(&tcache_depot_lock);
+}
+
+/*
+ * Carves a new slab into objects of class cls and pushes them onto bin.
+ * Slabs are colored: successive slabs of a class place their first object
+ * at rotating cache line offsets within a span of opt.slab_colors lines,
+ * so objects at the same index of different slabs, which tend to be
+ * equally hot, do not all map to the same cache sets.
+ */
+int tcache_carve_slab(struct tcache_bin* bin, int cls) {
+    pthread_mutex_lock(&mems_lock);
+    size_t colors = mems_opt_slab_colors;
+    size_t color = tcache_next_color[cls]++ % colors;
+    void* v_ptr = mems_malloc_unlocked(TCACHE_SLAB_SIZE + colors * TCACHE_ALIGN);
+    char* p_addr = v_ptr != NULL ? (char*)mems_get_unlocked(v_ptr) : NULL;
+    if (p_addr != NULL) {
+        tcache_slabs++;
+        tcache_class_slabs[cls]++;
+    }
+    pthread_mutex_unlock(&mems_lock);
+    if (p_addr == NULL) {
+        return -1;
+    }
+
+    // The first line at or after p_addr whose offset within the color span is the slab's color
+    size_t span = colors * TCACHE_ALIGN;
+    uintptr_t aligned = ((uintptr_t)p_addr + TCACHE_ALIGN - 1) & ~(uintptr_t)(TCACHE_ALIGN - 1);
+    char* object = (char*)aligned + (color * TCACHE_ALIGN + span - aligned % span) % span;
+    size_t object_size = tcache_class_sizes[cls];
+    for (size_t i = TCACHE_SLAB_SIZE / object_size; i > 0; i--) {
+        *(void**)object = bin->head;
+        bin->head = object;
+        bin->count++;
+        object += object_size;
+    }
+    return 0;
+}
+
+/*
+* Work stealing. Objects a thread spills from a full bin are not handed to
+* the locked depot right away: they are pushed as one batch onto that
+* thread's Chase-Lev deque for the size class. The owner pops its newest
+* batch when its bin runs empty, and a thread whose own deque is empty too
+* steals the oldest batch of a peer before it tries the depot. Only the
+* owner pushes and pops at the bottom of a deque, thieves take from the top
+* with a compare-and-swap, so batches move between threads without a lock.
+* A deque has a fixed capacity; when it is full, spills go to the depot.
+* Every entry carries the tcache_generation it was pushed in, and entries
+* from before a heap reset are dropped unread.
+*/
+#define TCACHE_DEQUE_SIZE 16 // Batches per deque, a power of two
+
+struct tcache_deque {
+    int64_t top __attribute__((aligned(64)));    // Next entry to steal
+    int64_t bottom __attribute__((aligned(64))); // Next free entry, written by the owner only
+    struct {
+        void* head;     // Objects linked through their first word
+        uint64_t meta;  // Object count in the low 32 bits, generation in the high ones
+    } entries[TCACHE_DEQUE_SIZE];
+};
+
+// The deques of one thread, linked into a registry that is only ever pushed to
+struct tcache_peer {
+    struct tcache_deque deques[TCACHE_CLASSES];
+    struct tcache_peer* next;
+    int in_use; // 0 once the owning thread exited, the next new thread takes it over
+};
+
+struct tcache_peer* tcache_peers = NULL;
+__thread struct tcache_peer* tcache_own_peer = NULL;
+pthread_key_t tcache_peer_key;
+pthread_once_t tcache_peer_once = PTHREAD_ONCE_INIT;
+
+// Pushes a batch onto the owner's end. Returns -1 if the deque is full.
+int deque_push(struct tcache_deque* deque, void* head, uint64_t meta) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= TCACHE_DEQUE_SIZE) {
+        return -1;
+    }
+    __atomic_store_n(&deque->entries[bottom & (TCACHE_DEQUE_SIZE - 1)].head, head, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->entries[bottom & (TCACHE_DEQUE_SIZE - 1)].meta, meta, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Pops the newest batch from the owner's end. Returns NULL if the deque is empty.
+void* deque_pop(struct tcache_deque* deque, uint64_t* meta) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    void* head = __atomic_load_n(&deque->entries[bottom & (TCACHE_DEQUE_SIZE - 1)].head, __ATOMIC_RELAXED);
+    *meta = __atomic_load_n(&deque->entries[bottom & (TCACHE_DEQUE_SIZE - 1)].meta, __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // The last batch, a thief may be taking it at the same time
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            head = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return head;
+}
+
+// Steals the oldest batch from the thieves' end. Returns NULL if the deque is empty or another thread won.
+void* deque_steal(struct tcache_deque* deque, uint64_t* meta) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return NULL;
+    }
+    // The owner cannot overwrite this entry while top is unchanged, as pushes stop when the deque is full
+    void* head = __atomic_load_n(&deque->entries[top & (TCACHE_DEQUE_SIZE - 1)].head, __ATOMIC_RELAXED);
+    *meta = __atomic_load_n(&deque->entries[top & (TCACHE_DEQUE_SIZE - 1)].meta, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return head;
+}
+
+// Runs when a thread that owns a peer exits: everything it cached goes to the depot for others to take
+void tcache_peer_release(void* peer) {
+    mems_tcache_flush();
+    __atomic_store_n(&((struct tcache_peer*)peer)->in_use, 0, __ATOMIC_RELEASE);
+    tcache_own_peer = NULL;
+}
+
+void tcache_peer_key_create() {
+    pthread_key_create(&tcache_peer_key, tcache_peer_release);
+}
+
+// The calling thread's deques, taking over those of an exited thread if possible
+struct tcache_peer* tcache_peer() {
+    if (tcache_own_peer != NULL) {
+        return tcache_own_peer;
+    }
+    pthread_once(&tcache_peer_once, tcache_peer_key_create);
+    struct tcache_peer* peer = __atomic_load_n(&tcache_peers, __ATOMIC_ACQUIRE);
+    for (; peer != NULL; peer = peer->next) {
+        int expected = 0;
+        if (__atomic_load_n(&peer->in_use, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&peer->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (peer == NULL) {
+        peer = (struct tcache_peer*)mmap(NULL, sizeof(struct tcache_peer), PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (peer == MAP_FAILED) {
+            return NULL;
+        }
+        peer->in_use = 1;
+        peer->next = __atomic_load_n(&tcache_peers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&tcache_peers, &peer->next, peer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(tcache_peer_key, peer);
+    tcache_own_peer = peer;
+    return peer;
+}
+
+/*
+ * Moves count objects from a bin onto the calling thread's deque as one
+ * batch, or to the depot if the deque is full or stealing is disabled.
+ */
+void tcache_offload(struct tcache_bin* bin, int cls, size_t count) {
+    struct tcache_peer* peer = mems_opt_tcache_steal ? tcache_peer() : NULL;
+    if (peer == NULL || count == 0 || count > bin->count) {
+        tcache_spill(bin, cls, count);
+        return;
+    }
+    void* head = bin->head;
+    void* last = head;
+    for (size_t i = 1; i < count; i++) {
+        last = *(void**)last;
+    }
+    uint64_t generation = __atomic_load_n(&tcache_generation, __ATOMIC_ACQUIRE);
+    if (deque_push(&peer->deques[cls], head, (generation << 32) | count) != 0) {
+        tcache_spill(bin, cls, count);
+        return;
+    }
+    bin->head = *(void**)last;
+    bin->count -= count;
+}
+
+// Puts a batch taken from a deque into an empty bin, unless it predates the last heap reset
+int tcache_accept(struct tcache_bin* bin, void* head, uint64_t meta) {
+    uint64_t generation = __atomic_load_n(&tcache_generation, __ATOMIC_ACQUIRE);
+    if (head == NULL || (meta >> 32) != (generation & 0xFFFFFFFF)) {
+        return -1;
+    }
+    bin->head = head;
+    bin->count = meta & 0xFFFFFFFF;
+    return 0;
+}
+
+/*
+ * Refills an empty bin from the calling thread's own deque, or else with a
+ * batch stolen from the first peer that has one.
+ * @return 0 if the bin was refilled, -1 if no deque had a batch to give.
+ */
+int tcache_steal(struct tcache_bin* bin, int cls) {
+    struct tcache_peer* own = tcache_peer();
+    if (own == NULL) {
+        return -1;
+    }
+    uint64_t meta;
+    void* head;
+    while ((head = deque_pop(&own->deques[cls], &meta)) != NULL) {
+        if (tcache_accept(bin, head, meta) == 0) {
+            flight_path = FLIGHT_PATH_BATCH;
+            return 0;
+        }
+    }
+    for (struct tcache_peer* peer = __atomic_load_n(&tcache_peers, __ATOMIC_ACQUIRE); peer != NULL; peer = peer->next) {
+        if (peer == own) {
+            continue;
+        }
+        while ((head = deque_steal(&peer->deques[cls], &meta)) != NULL) {
+            if (tcache_accept(bin, head, meta) == 0) {
+                __atomic_add_fetch(&tcache_steals, 1, __ATOMIC_RELAXED);
+                flight_path = FLIGHT_PATH_STEAL;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Refills an empty bin from the deques, then from the depot, and from a
+ * new slab if the depot is empty too.
+ */
+int tcache_refill(struct tcache_bin* bin, int cls) {
+    if (mems_opt_tcache_steal && tcache_steal(bin, cls) == 0) {
+        return 0;
+    }
+    size_t batch = mems_opt_tcache_max / 2 > 0 ? mems_opt_tcache_max / 2 : 1;
+    pthread_mutex_lock(&tcache_depot_lock);
+    tcache_move(depot_bin(cls), bin, batch);
+    pthread_mutex_unlock(&tcache_depot_lock);
+    if (bin->head != NULL) {
+        flight_path = FLIGHT_PATH_DEPOT;
+        return 0;
+    }
+
+    if (tcache_carve_slab(bin, cls) != 0) {
+        return -1;
+    }
+    flight_path = FLIGHT_PATH_SLAB;
+    if (bin->count > mems_opt_tcache_max) {
+        tcache_offload(bin, cls, bin->count - mems_opt_tcache_max);
+    }
+    return 0;
+}
+
+/*
+ * Allocates a small object from the calling thread's cache.
+ * Objects are aligned to 64 bytes and must be released with
+ * mems_tcache_free() and the same size.
+ * @param size The object size, at most TCACHE_MAX_SIZE bytes.
+ * @return A physical pointer to the object, or NULL if size is too large
+ *         or no memory is available.
+ */
+void* mems_tcache_alloc(size_t size) {
+    int cls = tcache_class(size);
+    if (cls < 0) {
+        return NULL;
+    }
+    uint64_t start = flight_start();
+    struct tcache_bin* bin = &current_tcache()->bins[cls];
+    flight_path = FLIGHT_PATH_BIN;
+    if (bin->head == NULL && tcache_refill(bin, cls) != 0) {
+        flight_record(FLIGHT_TCACHE_ALLOC, size, NULL, start);
+        return NULL;
+    }
+    void* object = bin->head;
+    bin->head = *(void**)object;
+    bin->count--;
+    flight_record(FLIGHT_TCACHE_ALLOC, size, object, start);
+    return object;
+}
+
+/*
+ * Returns an object to the calling thread's cache. Objects may be freed by
+ * a different thread than the one that allocated them.
+ * @param ptr The pointer returned by mems_tcache_alloc().
+ * @param size The size that was passed to mems_tcache_alloc().
+ */
+void mems_tcache_free(void* ptr, size_t size) {
+    int cls = tcache_class(size);
+    if (ptr == NULL || cls < 0) {
+        return;
+    }
+    uint64_t start = flight_start();
+    struct tcache_bin* bin = &current_tcache()->bins[cls];
+    *(void**)ptr = bin->head;
+    bin->head = ptr;
+    bin->count++;
+    flight_path = FLIGHT_PATH_BIN;
+    if (bin->count > mems_opt_tcache_max) {
+        tcache_offload(bin, cls, bin->count / 2);
+        flight_path = FLIGHT_PATH_SPILL;
+    }
+    flight_record(FLIGHT_TCACHE_FREE, size, ptr, start);
+}
+
+/*
+ * Moves every object cached by the calling thread, including the batches
+ * on its deques, to the shared depot, where other threads can reuse them.
+ */
+void mems_tcache_flush() {
+    struct tcache* cache = current_tcache();
+    for (int cls = 0; cls < TCACHE_CLASSES; cls++) {
+        if (cache->bins[cls].count != 0) {
+            tcache_spill(&cache->bins[cls], cls, cache->bins[cls].count);
+        }
+        uint64_t meta;
+        void* head;
+        while (tcache_own_peer != NULL && (head = deque_pop(&tcache_own_peer->deques[cls], &meta)) != NULL) {
+            if (tcache_accept(&cache->bins[cls], head, meta) == 0) {
+                tcache_spill(&cache->bins[cls], cls, cache->bins[cls].count);
+            }
+        }
+    }
+}
+
+/*
+* Walks the physical extents backing a range of MeMS virtual addresses.
+* An extent is a run of allocated segments that is contiguous in physical
+* memory, i.e. within one main_node. The range may continue into the next
+* main_node when their virtual ranges touch.
+*/
+struct range_cursor {
+    struct main_node* main;
+    struct sub_node* sub;   // Last segment covered by the current extent
+    char* p_addr;           // Start of the current extent
+    size_t extent_len;      // Bytes left in the current extent
+    size_t remaining;       // Bytes left in the whole range
+};
+
+// Grows the current extent over the physically adjacent segments that follow
+void range_coalesce(struct range_cursor* cursor) {
+    while (cursor->extent_len < cursor->remaining && cursor->sub->next != NULL && cursor->sub->next->type == PROCESS) {
+        cursor->sub = cursor->sub->next;
+        cursor->extent_len += cursor->sub->size;
+    }
+    if (cursor->extent_len > cursor->remaining) {
+        cursor->extent_len = cursor->remaining;
+    }
+}
+
+/*
+ * Positions a cursor at the start of a virtual range.
+ * @return 0 on success, -1 if v_ptr is not inside an allocated segment.
+ */
+int range_start(struct range_cursor* cursor, const void* v_ptr, size_t len) {
+    struct main_node* node = find_main_node(v_ptr);
+    if (node == NULL) {
+        return -1;
+    }
+    for (struct sub_node* sub = node->sub_head; sub != NULL; sub = sub->next) {
+        if (v_ptr >= sub->v_addr_start && v_ptr <= sub->v_addr_end) {
+            if (sub->type != PROCESS) {
+                return -1;
+            }
+            size_t offset = (const char*)v_ptr - (const char*)sub->v_addr_start;
+            cursor->main = node;
+            cursor->sub = sub;
+            cursor->p_addr = (char*)sub->p_addr + offset;
+            cursor->extent_len = sub->size - offset;
+            cursor->remaining = len;
+            range_coalesce(cursor);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Consumes n bytes of the current extent, moving on to the next extent
+ * when it is used up.
+ * @return 0 on success, -1 if the range runs into a hole or unmapped space.
+ */
+int range_advance(struct range_cursor* cursor, size_t n) {
+    cursor->p_addr += n;
+    cursor->extent_len -= n;
+    cursor->remaining -= n;
+    if (cursor->extent_len != 0 || cursor->remaining == 0) {
+        return 0;
+    }
+
+    struct sub_node* next = cursor->sub->next;
+    if (next == NULL) {
+        struct main_node* next_main = cursor->main->next;
+        if (next_main == head_main || next_main->v_addr_start != cursor->main->v_addr_end + 1) {
+            return -1;
+        }
+        cursor->main = next_main;
+        next = next_main->sub_head;
+    }
+    if (next->type != PROCESS) {
+        return -1;
+    }
+    cursor->sub = next;
+    cursor->p_addr = (char*)next->p_addr;
+    cursor->extent_len = next->size;
+    range_coalesce(cursor);
+    return 0;
+}
+
+// Checks that every byte of a virtual range lies in an allocated segment
+int range_valid(const void* v_ptr, size_t len) {
+    struct range_cursor cursor;
+    if (len == 0) {
+        return 1;
+    }
+    if (range_start(&cursor, v_ptr, len) != 0) {
+        return 0;
+    }
+    while (cursor.remaining != 0) {
+        if (range_advance(&cursor, cursor.extent_len) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void copy_extent(char* dst, const char* src, size_t n, int nontemporal) {
+#ifdef __SSE2__
+    if (nontemporal && n >= 128) {
+        size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        n -= head;
+        // Streaming stores skip the cache so large copies do not evict the working set
+        for (; n >= 64; n -= 64, dst += 64, src += 64) {
+            __m128i a = _mm_loadu_si128((const __m128i*)src);
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+            __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+            _mm_stream_si128((__m128i*)dst, a);
+            _mm_stream_si128((__m128i*)(dst + 16), b);
+            _mm_stream_si128((__m128i*)(dst + 32), c);
+            _mm_stream_si128((__m128i*)(dst + 48), d);
+        }
+        _mm_sfence();
+    }
+#else
+    (void)nontemporal;
+#endif
+    memcpy(dst, src, n);
+}
+
+void fill_extent(char* dst, int c, size_t n, int nontemporal) {
+#ifdef __SSE2__
+    if (nontemporal && n >= 128) {
+        size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+        memset(dst, c, head);
+        dst += head;
+        n -= head;
+        __m128i value = _mm_set1_epi8((char)c);
+        for (; n >= 64; n -= 64, dst += 64) {
+            _mm_stream_si128((__m128i*)dst, value);
+            _mm_stream_si128((__m128i*)(dst + 16), value);
+            _mm_stream_si128((__m128i*)(dst + 32), value);
+            _mm_stream_si128((__m128i*)(dst + 48), value);
+        }
+        _mm_sfence();
+    }
+#else
+    (void)nontemporal;
+#endif
+    memset(dst, c, n);
+}
+
+int compare_extent(const char* a, const char* b, size_t n) {
+#ifdef __SSE2__
+    for (; n >= 16; n -= 16, a += 16, b += 16) {
+        int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b)));
+        if (equal != 0xFFFF) {
+            int index = __builtin_ctz(~equal);
+            return (int)(unsigned char)a[index] - (int)(unsigned char)b[index];
+        }
+    }
+#endif
+    return memcmp(a, b, n);
+}
+
+/*
+ * Copies n bytes between two MeMS virtual ranges, splitting the copy at
+ * physical extent boundaries. Copies of at least mems_opt_nt_threshold
+ * bytes use non-temporal stores. The ranges must not overlap.
+ * @param v_dst The destination MeMS virtual address.
+ * @param v_src The source MeMS virtual address.
+ * @param n The number of bytes to copy.
+ * @return v_dst, or NULL if either range is not entirely allocated, in which
+ *         case nothing is copied.
+ */
+void* mems_memcpy(void* v_dst, const void* v_src, size_t n) {
+    pthread_mutex_lock(&mems_lock);
+    struct range_cursor dst;
+    struct range_cursor src;
+    if (!range_valid(v_dst, n) || !range_valid(v_src, n)) {
+        pthread_mutex_unlock(&mems_lock);
+        return NULL;
+    }
+    if (n != 0) {
+        int nontemporal = n >= mems_opt_nt_threshold;
+        range_start(&dst, v_dst, n);
+        range_start(&src, v_src, n);
+        while (dst.remaining != 0) {
+            size_t chunk = dst.extent_len < src.extent_len ? dst.extent_len : src.extent_len;
+            copy_extent(dst.p_addr, src.p_addr, chunk, nontemporal);
+            range_advance(&dst, chunk);
+            range_advance(&src, chunk);
+        }
+    }
+    pthread_mutex_unlock(&mems_lock);
+    return v_dst;
+}
+
+/*
+ * Fills n bytes of a MeMS virtual range with the byte c. Fills of at least
+ * mems_opt_nt_threshold bytes use non-temporal stores.
+ * @param v_dst The MeMS virtual address to start at.
+ * @param c The byte value.
+ * @param n The number of bytes to fill.
+ * @return v_dst, or NULL if the range is not entirely allocated, in which
+ *         case nothing is written.
+ */
+void* mems_memset(void* v_dst, int c, size_t n) {
+    pthread_mutex_lock(&mems_lock);
+    struct range_cursor dst;
+    if (!range_valid(v_dst, n)) {
+        pthread_mutex_unlock(&mems_lock);
+        return NULL;
+    }
+    if (n != 0) {
+        int nontemporal = n >= mems_opt_nt_threshold;
+        range_start(&dst, v_dst, n);
+        while (dst.remaining != 0) {
+            fill_extent(dst.p_addr, c, dst.extent_len, nontemporal);
+            range_advance(&dst, dst.extent_len);
+        }
+    }
+    pthread_mutex_unlock(&mems_lock);
+    return v_dst;
+}
+
+/*
+ * Compares n bytes of two MeMS virtual ranges like memcmp().
+ * @param v_a The first MeMS virtual address.
+ * @param v_b The second MeMS virtual address.
+ * @param n The number of bytes to compare.
+ * @return Less than, equal to or greater than 0 as for memcmp(). If either
+ *         range is not entirely allocated, errno is set to EFAULT and -1 is
+ *         returned.
+ */
+int mems_memcmp(const void* v_a, const void* v_b, size_t n) {
+    pthread_mutex_lock(&mems_lock);
+    struct range_cursor a;
+    struct range_cursor b;
+    int result = 0;
+    if (!range_valid(v_a, n) || !range_valid(v_b, n)) {
+        pthread_mutex_unlock(&mems_lock);
+        errno = EFAULT;
+        return -1;
+    }
+    if (n != 0) {
+        range_start(&a, v_a, n);
+        range_start(&b, v_b, n);
+        while (a.remaining != 0 && result == 0) {
+            size_t chunk = a.extent_len < b.extent_len ? a.extent_len : b.extent_len;
+            result = compare_extent(a.p_addr, b.p_addr, chunk);
+            range_advance(&a, chunk);
+            range_advance(&b, chunk);
+        }
+    }
+    pthread_mutex_unlock(&mems_lock);
+    return result;
+}
+
+// Kinds of vectored I/O performed by vectored_io()
+#define IO_READ 0
+#define IO_WRITE 1
+#define IO_PREAD 2
+#define IO_PWRITE 3
+
+/*
+ * Performs vectored I/O on MeMS virtual ranges. The ranges are translated
+ * into physical iovecs, one per extent, under mems_lock; the system calls
+ * run without the lock, in batches of at most IOV_MAX extents.
+ */
+ssize_t vectored_io(int op, int fd, const struct iovec* v_iov, int iovcnt, off_t offset) {
+    struct iovec iov[IOV_MAX];
+    struct range_cursor cursor;
+
+    pthread_mutex_lock(&mems_lock);
+    for (int i = 0; i < iovcnt; i++) {
+        if (!range_valid(v_iov[i].iov_base, v_iov[i].iov_len)) {
+            pthread_mutex_unlock(&mems_lock);
+            errno = EFAULT;
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&mems_lock);
+
+    ssize_t total = 0;
+    int index = 0;
+    size_t consumed = 0; // Bytes of v_iov[index] already placed in a batch
+    while (index < iovcnt) {
+        int count = 0;
+        size_t batch_bytes = 0;
+        pthread_mutex_lock(&mems_lock);
+        while (index < iovcnt && count < IOV_MAX) {
+            size_t left = v_iov[index].iov_len - consumed;
+            if (left != 0) {
+                range_start(&cursor, (char*)v_iov[index].iov_base + consumed, left);
+                while (cursor.remaining != 0 && count < IOV_MAX) {
+                    iov[count].iov_base = cursor.p_addr;
+                    iov[count].iov_len = cursor.extent_len;
+                    count++;
+                    batch_bytes += cursor.extent_len;
+                    consumed += cursor.extent_len;
+                    range_advance(&cursor, cursor.extent_len);
+                }
+                if (cursor.remaining != 0) {
+                    break;
+                }
+            }
+            index++;
+            consumed = 0;
+        }
+        pthread_mutex_unlock(&mems_lock);
+        if (count == 0) {
+            break;
+        }
+
+        ssize_t done;
+        switch (op) {
+        case IO_READ: done = readv(fd, iov, count); break;
+        case IO_WRITE: done = writev(fd, iov, count); break;
+        case IO_PREAD: done = preadv(fd, iov, count, offset); break;
+        default: done = pwritev(fd, iov, count, offset); break;
+        }
+        if (done < 0) {
+            return total != 0 ? total : -1;
+        }
+        total += done;
+        offset += done;
+        if ((size_t)done < batch_bytes) {
+            break;
+        }
+    }
+    return total;
+}
+
+/*
+ * Reads from fd straight into MeMS virtual ranges, like readv(). Each iovec's
+ * iov_base is a MeMS virtual address; ranges may span several segments. The
+ * segments must stay allocated until the call returns.
+ * @param fd The file descriptor to read from.
+ * @param v_iov The virtual ranges to fill, in order.
+ * @param iovcnt The number of ranges.
+ * @return The number of bytes read, or -1 with errno set. errno is EFAULT if
+ *         a range is not entirely allocated, in which case nothing is read.
+ */
+ssize_t mems_readv(int fd, const struct iovec* v_iov, int iovcnt) {
+    return vectored_io(IO_READ, fd, v_iov, iovcnt, 0);
+}
+
+/*
+ * Writes MeMS virtual ranges to fd, like writev(). See mems_readv().
+ * @return The number of bytes written, or -1 with errno set.
+ */
+ssize_t mems_writev(int fd, const struct iovec* v_iov, int iovcnt) {
+    return vectored_io(IO_WRITE, fd, v_iov, iovcnt, 0);
+}
+
+/*
+ * Reads from fd at the given file offset into MeMS virtual ranges, like
+ * preadv(). See mems_readv().
+ * @return The number of bytes read, or -1 with errno set.
+ */
+ssize_t mems_preadv(int fd, const struct iovec* v_iov, int iovcnt, off_t offset) {
+    return vectored_io(IO_PREAD, fd, v_iov, iovcnt, offset);
+}
+
+/*
+ * Writes MeMS virtual ranges to fd at the given file offset, like
+ * pwritev(). See mems_readv().
+ * @return The number of bytes written, or -1 with errno set.
+ */
+ssize_t mems_pwritev(int fd, const struct iovec* v_iov, int iovcnt, off_t offset) {
+    return vectored_io(IO_PWRITE, fd, v_iov, iovcnt, offset);
+}
+
+/*
+* A pool of fixed-size, page-aligned buffers for O_DIRECT and similar I/O.
+* The buffers live in a dedicated main_node whose pages are populated and
+* mlock'ed up front. That main_node is never reset, freed, purged, grown or
+* compacted, so buffer addresses stay valid and resident for the pool's
+* lifetime. Free buffers are kept on a stack, making acquire and release O(1).
+*/
+struct mems_buffer_pool {
+    struct main_node* node;
+    char* p_addr;            // Physical address of the first buffer
+    size_t buffer_size;      // A multiple of PAGE_SIZE
+    size_t count;
+    size_t free_count;
+    void** free_stack;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Creates a buffer pool.
+ * @param buffer_size The size of each buffer, rounded up to whole pages.
+ * @param count The number of buffers.
+ * @return The pool, or NULL if mapping or locking the memory failed.
+ */
+struct mems_buffer_pool* mems_buffer_pool_create(size_t buffer_size, size_t count) {
+    if (buffer_size == 0 || count == 0) {
+        return NULL;
+    }
+    buffer_size = (buffer_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    if (buffer_size * count > INT32_MAX) {
+        return NULL;
+    }
+
+    size_t header_size = sizeof(struct mems_buffer_pool) + count * sizeof(void*);
+    header_size = (header_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    struct mems_buffer_pool* pool = (struct mems_buffer_pool*)mmap(NULL, header_size, PROT_READ | PROT_WRITE,
+                                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        perror("mmap failed on mems_buffer_pool_create");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mems_lock);
+    struct main_node* node = map_main_node((int)(buffer_size * count / PAGE_SIZE), MAP_POPULATE);
+    if (node == NULL || mlock(node->p_addr, buffer_size * count) != 0) {
+        if (node != NULL) {
+            perror("mlock failed on mems_buffer_pool_create");
+            // Hand the pages back to the heap as an ordinary hole
+            struct sub_node* hole = add_sub_node();
+            hole->type = HOLE;
+            hole->size = (int)(buffer_size * count);
+            hole->p_addr = node->p_addr;
+            hole->v_addr_start = node->v_addr_start;
+            hole->v_addr_end = node->v_addr_end;
+            hole->next = NULL;
+            hole->prev = NULL;
+            node->sub_head = hole;
+        }
+        pthread_mutex_unlock(&mems_lock);
+        munmap(pool, header_size);
+        return NULL;
+    }
+    node->flags |= MAIN_LOCKED;
+    struct sub_node* segment = add_sub_node();
+    segment->type = PROCESS;
+    segment->size = (int)(buffer_size * count);
+    segment->p_addr = node->p_addr;
+    segment->v_addr_start = node->v_addr_start;
+    segment->v_addr_end = node->v_addr_end;
+    segment->next = NULL;
+    segment->prev = NULL;
+    node->sub_head = segment;
+    pthread_mutex_unlock(&mems_lock);
+
+    pool->node = node;
+    pool->p_addr = (char*)node->p_addr;
+    pool->buffer_size = buffer_size;
+    pool->count = count;
+    pool->free_count = count;
+    pool->free_stack = (void**)(pool + 1);
+    for (size_t i = 0; i < count; i++) {
+        pool->free_stack[i] = pool->p_addr + (count - 1 - i) * buffer_size;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+/*
+ * Takes a buffer from the pool.
+ * @return The physical address of a page-aligned buffer, or NULL if all
+ *         buffers are in use.
+ */
+void* mems_buffer_acquire(struct mems_buffer_pool* pool) {
+    void* buffer = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count != 0) {
+        buffer = pool->free_stack[--pool->free_count];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return buffer;
+}
+
+/*
+ * Returns a buffer to the pool. Pointers that do not belong to the pool
+ * are ignored.
+ * @param buffer A buffer returned by mems_buffer_acquire().
+ */
+void mems_buffer_release(struct mems_buffer_pool* pool, void* buffer) {
+    size_t offset = (char*)buffer - pool->p_addr;
+    if ((char*)buffer < pool->p_addr || offset >= pool->buffer_size * pool->count || offset % pool->buffer_size != 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count < pool->count) {
+        pool->free_stack[pool->free_count++] = buffer;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Translates a pool buffer to its MeMS virtual address, for use with the
+ * mems_* range and I/O functions.
+ */
+void* mems_buffer_v_addr(struct mems_buffer_pool* pool, void* buffer) {
+    return pool->node->v_addr_start + ((char*)buffer - pool->p_addr);
+}
+
+/*
+ * Destroys a pool. Its pages are unlocked and handed back to the heap as a
+ * hole; outstanding buffers must not be used afterwards.
+ */
+void mems_buffer_pool_destroy(struct mems_buffer_pool* pool) {
+    pthread_mutex_lock(&mems_lock);
+    struct main_node* node = pool->node;
+    munlock(node->p_addr, (size_t)node->num_of_pages * PAGE_SIZE);
+    node->flags &= ~MAIN_LOCKED;
+    node->sub_head->type = HOLE;
+    mems_epoch++;
+    pthread_mutex_unlock(&mems_lock);
+
+    pthread_mutex_destroy(&pool->lock);
+    size_t header_size = sizeof(struct mems_buffer_pool) + pool->count * sizeof(void*);
+    munmap(pool, (header_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE);
+}
+
+/*
+* Memory pressure handling. The monitor maps what it reads to a level:
+*   1: "some" pressure above opt.pressure_psi or the cgroup above
+*      opt.pressure_cgroup of memory.high. Hole pages are purged and the
+*      tunables switch to memory-saving values.
+*   2: twice that pressure or the cgroup halfway to memory.high. Mappings
+*      that hold nothing are unmapped and the thread caches are shrunk.
+*   3: "full" pressure above opt.pressure_psi or the cgroup at memory.high.
+*      Trailing hole pages of every mapping are unmapped as well.
+* When pressure is gone, the saved tunables are restored.
+*/
+#define PRESSURE_NONE 0
+#define PRESSURE_LOW 1
+#define PRESSURE_MEDIUM 2
+#define PRESSURE_HIGH 3
+
+// Tunables in effect before pressure was first seen
+struct pressure_saved {
+    int active;
+    double growth_factor;
+    size_t purge_decay;
+    size_t tcache_max;
+    size_t adaptive;
+};
+
+struct pressure_saved pressure_saved;
+
+pthread_t pressure_thread;
+int pressure_running = 0;
+int pressure_stopping = 0;
+pthread_mutex_t pressure_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pressure_cond = PTHREAD_COND_INITIALIZER;
+char pressure_cgroup_dir[PATH_MAX];
+
+// Unlinks a main_node and unmaps its pages. The caller holds mems_lock.
+size_t release_main_node(struct main_node* node) {
+    size_t bytes = (size_t)node->num_of_pages * PAGE_SIZE;
+    if (munmap(node->p_addr, bytes) == -1) {
+        perror("munmap failed on release_main_node");
+        return 0;
+    }
+    struct sub_node* current_sub_node = node->sub_head;
+    while (current_sub_node != NULL) {
+        struct sub_node* next = current_sub_node->next;
+        release_sub_node(current_sub_node);
+        current_sub_node = next;
+    }
+    if (mems_opt_tagged_vaddr) {
+        main_slots[((uintptr_t)node->v_addr_start >> TAG_SHIFT) - 1] = NULL;
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = free_main_nodes;
+    free_main_nodes = node;
+    mapped_pages -= bytes / PAGE_SIZE;
+    return bytes;
+}
+
+/*
+ * Unmaps every main_node that is a single hole. The virtual range of a
+ * released node is left as a gap in the main chain.
+ * @return The number of bytes unmapped.
+ */
+size_t release_empty_nodes() {
+    size_t released = 0;
+    struct main_node* current_main_node = head_main->next;
+    while (current_main_node != head_main) {
+        struct main_node* next = current_main_node->next;
+        struct sub_node* sub_head = current_main_node->sub_head;
+        if (!(current_main_node->flags & MAIN_LOCKED) && sub_head != NULL && sub_head->type == HOLE &&
+            sub_head->next == NULL) {
+            released += release_main_node(current_main_node);
+        }
+        current_main_node = next;
+    }
+    return released;
+}
+
+/*
+ * Shrinks every mapping that ends in a hole to drop the whole pages of that
+ * hole. The main_node keeps its start address, so live segments are not
+ * moved, and the freed virtual range becomes a gap before the next node.
+ * @return The number of bytes unmapped.
+ */
+size_t trim_trailing_holes() {
+    size_t trimmed = 0;
+    struct main_node* current_main_node = head_main->next;
+    while (current_main_node != head_main) {
+        struct sub_node* last = current_main_node->sub_head;
+        while (last != NULL && last->next != NULL) {
+            last = last->next;
+        }
+        if (current_main_node->flags & MAIN_LOCKED || last == NULL || last->type != HOLE || last->prev == NULL) {
+            current_main_node = current_main_node->next;
+            continue;
+        }
+        size_t hole_offset = (char*)last->p_addr - (char*)current_main_node->p_addr;
+        size_t keep_pages = (hole_offset + PAGE_SIZE - 1) / PAGE_SIZE;
+        size_t drop_pages = current_main_node->num_of_pages - keep_pages;
+        if (drop_pages != 0 &&
+            mremap(current_main_node->p_addr, (size_t)current_main_node->num_of_pages * PAGE_SIZE,
+                   keep_pages * PAGE_SIZE, 0) != MAP_FAILED) {
+            current_main_node->num_of_pages = (int)keep_pages;
+            current_main_node->v_addr_end = current_main_node->v_addr_start + keep_pages * PAGE_SIZE - 1;
+            last->size -= (int)(drop_pages * PAGE_SIZE);
+            last->v_addr_end = current_main_node->v_addr_end;
+            if (last->size == 0) {
+                last->prev->next = NULL;
+                release_sub_node(last);
+            }
+            trimmed += drop_pages * PAGE_SIZE;
+            mapped_pages -= drop_pages;
+        }
+        current_main_node = current_main_node->next;
+    }
+    return trimmed;
+}
+
+/*
+ * Runs the reclaim steps for a pressure level, switching to memory-saving
+ * tunables on the first call and restoring the saved ones for
+ * PRESSURE_NONE. Called by the monitor, but can also be used directly,
+ * e.g. from an application's own low-memory handler.
+ * @param level PRESSURE_NONE to PRESSURE_HIGH.
+ * @return The number of bytes handed back to the OS.
+ */
+size_t mems_relieve_pressure(int level) {
+    size_t released = 0;
+    pthread_mutex_lock(&mems_lock);
+    if (level == PRESSURE_NONE) {
+        if (pressure_saved.active) {
+            mems_opt_growth_factor = pressure_saved.growth_factor;
+            mems_opt_purge_decay = pressure_saved.purge_decay;
+            mems_opt_tcache_max = pressure_saved.tcache_max;
+            mems_opt_adaptive = pressure_saved.adaptive;
+            pressure_saved.active = 0;
+        }
+        pthread_mutex_unlock(&mems_lock);
+        return 0;
+    }
+
+    if (!pressure_saved.active) {
+        pressure_saved.growth_factor = mems_opt_growth_factor;
+        pressure_saved.purge_decay = mems_opt_purge_decay;
+        pressure_saved.tcache_max = mems_opt_tcache_max;
+        pressure_saved.adaptive = mems_opt_adaptive;
+        pressure_saved.active = 1;
+        mems_opt_adaptive = 0;
+        mems_opt_growth_factor = 1.0;
+        if (mems_opt_purge_decay == 0 || mems_opt_purge_decay > 64) {
+            mems_opt_purge_decay = 64;
+        }
+    }
+    if (level >= PRESSURE_MEDIUM) {
+        // Bins above the new limit spill to the depot on their next free
+        mems_opt_tcache_max = pressure_saved.tcache_max / 4 > 0 ? pressure_saved.tcache_max / 4 : 1;
+        released += release_empty_nodes();
+    }
+    if (level >= PRESSURE_HIGH) {
+        released += trim_trailing_holes();
+    }
+    released += purge_holes();
+    frees_since_purge = 0;
+    if (level >= PRESSURE_MEDIUM) {
+        mems_epoch++;
+    }
+    pressure_released += released;
+    pthread_mutex_unlock(&mems_lock);
+    if (level >= PRESSURE_MEDIUM) {
+        mems_tcache_flush();
+    }
+    return released;
+}
+
+// Reads the "avg10" value of the "some" or "full" line of /proc/pressure/memory
+double read_psi_avg10(const char* kind) {
+    double avg10 = 0.0;
+    char line[256];
+    FILE* psi = fopen("/proc/pressure/memory", "r");
+    if (psi == NULL) {
+        return 0.0;
+    }
+    while (fgets(line, sizeof(line), psi) != NULL) {
+        size_t len = strlen(kind);
+        if (strncmp(line, kind, len) == 0 && sscanf(line + len, " avg10=%lf", &avg10) == 1) {
+            break;
+        }
+    }
+    fclose(psi);
+    return avg10;
+}
+
+// Reads a cgroup v2 memory file; "max" and missing files read as 0
+size_t read_cgroup_value(const char* file) {
+    char path[PATH_MAX + 32];
+    unsigned long long value = 0;
+    snprintf(path, sizeof(path), "%s/%s", pressure_cgroup_dir, file);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    if (fscanf(f, "%llu", &value) != 1) {
+        value = 0;
+    }
+    fclose(f);
+    return (size_t)value;
+}
+
+// Finds the calling process's cgroup v2 directory from /proc/self/cgroup
+void find_cgroup_dir() {
+    char line[PATH_MAX];
+    pressure_cgroup_dir[0] = '\0';
+    FILE* cgroup = fopen("/proc/self/cgroup", "r");
+    if (cgroup == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), cgroup) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(pressure_cgroup_dir, sizeof(pressure_cgroup_dir), "/sys/fs/cgroup%s", line + 3);
+            break;
+        }
+    }
+    fclose(cgroup);
+}
+
+// Maps the current PSI and cgroup readings to a pressure level
+int sample_pressure() {
+    double some = read_psi_avg10("some");
+    double full = read_psi_avg10("full");
+    double ratio = 0.0;
+    if (pressure_cgroup_dir[0] != '\0') {
+        size_t limit = read_cgroup_value("memory.high");
+        if (limit == 0) {
+            limit = read_cgroup_value("memory.max");
+        }
+        if (limit != 0) {
+            ratio = (double)read_cgroup_value("memory.current") / (double)limit;
+        }
+    }
+
+    double psi = mems_opt_pressure_psi;
+    double cgroup = mems_opt_pressure_cgroup;
+    if ((psi > 0 && full >= psi) || (cgroup > 0 && ratio >= 1.0)) {
+        return PRESSURE_HIGH;
+    }
+    if ((psi > 0 && some >= 2 * psi) || (cgroup > 0 && ratio >= (1.0 + cgroup) / 2)) {
+        return PRESSURE_MEDIUM;
+    }
+    if ((psi > 0 && some >= psi) || (cgroup > 0 && ratio >= cgroup)) {
+        return PRESSURE_LOW;
+    }
+    return PRESSURE_NONE;
+}
+
+void* pressure_monitor(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&pressure_lock);
+    while (!pressure_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t ns = (uint64_t)deadline.tv_nsec + mems_opt_pressure_interval_ms * 1000000ull;
+        deadline.tv_sec += ns / 1000000000ull;
+        deadline.tv_nsec = ns % 1000000000ull;
+        pthread_cond_timedwait(&pressure_cond, &pressure_lock, &deadline);
+        if (pressure_stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&pressure_lock);
+
+        int level = sample_pressure();
+        if ((size_t)level > pressure_level) {
+            pressure_escalations++;
+        }
+        if (level != PRESSURE_NONE || pressure_level != PRESSURE_NONE) {
+            mems_relieve_pressure(level);
+        }
+        pressure_level = level;
+
+        pthread_mutex_lock(&pressure_lock);
+    }
+    pthread_mutex_unlock(&pressure_lock);
+    return NULL;
+}
+
+/*
+ * Starts the memory pressure monitor thread. mems_init() calls it when
+ * opt.pressure is set; calling it again while running does nothing.
+ * @return 0 on success, -1 if the thread could not be created.
+ */
+int mems_pressure_start() {
+    int ret = 0;
+    pthread_mutex_lock(&pressure_lock);
+    if (!pressure_running) {
+        find_cgroup_dir();
+        pressure_stopping = 0;
+        if (pthread_create(&pressure_thread, NULL, pressure_monitor, NULL) != 0) {
+            perror("pthread_create failed on mems_pressure_start");
+            ret = -1;
+        } else {
+            pressure_running = 1;
+        }
+    }
+    pthread_mutex_unlock(&pressure_lock);
+    return ret;
+}
+
+/*
+ * Stops the memory pressure monitor and restores the tunables it changed.
+ * Must not be called with mems_lock held.
+ */
+void mems_pressure_stop() {
+    pthread_mutex_lock(&pressure_lock);
+    if (!pressure_running) {
+        pthread_mutex_unlock(&pressure_lock);
+        return;
+    }
+    pressure_stopping = 1;
+    pthread_cond_signal(&pressure_cond);
+    pthread_mutex_unlock(&pressure_lock);
+    pthread_join(pressure_thread, NULL);
+    pressure_running = 0;
+    pressure_level = PRESSURE_NONE;
+    mems_relieve_pressure(PRESSURE_NONE);
+}
+
+/*
+* RSS target pacing. Purging starts once the measured footprint exceeds
+* the target and continues, one bounded step per interval, until it falls
+* below the low watermark. The gap between the two keeps MeMS from
+* purging on every step while hovering around the target, and the step
+* budget keeps any single free from paying for a large purge.
+*/
+#define RSS_LOW_WATERMARK(target) ((target) - (target) / 8)
+
+int rss_purging = 0;
+void* rss_cursor = NULL; // MeMS virtual address the next pacing step starts from
+
+// Counts the resident pages of every mapping with mincore
+size_t measure_resident() {
+    unsigned char vec[1024];
+    size_t resident = 0;
+    struct main_node* current_main_node = head_main->next;
+    while (current_main_node != head_main) {
+        size_t pages = current_main_node->num_of_pages;
+        for (size_t first = 0; first < pages; first += sizeof(vec)) {
+            size_t count = pages - first < sizeof(vec) ? pages - first : sizeof(vec);
+            if (mincore((char*)current_main_node->p_addr + first * PAGE_SIZE, count * PAGE_SIZE, vec) != 0) {
+                break;
+            }
+            for (size_t i = 0; i < count; i++) {
+                resident += vec[i] & 1;
+            }
+        }
+        current_main_node = current_main_node->next;
+    }
+    return resident * PAGE_SIZE;
+}
+
+/*
+ * Purges holes from rss_cursor on, wrapping around once, until budget
+ * bytes were released. Mappings that were already purged completely on an
+ * earlier pass are idle and are unmapped.
+ * @return The number of bytes released.
+ */
+size_t purge_holes_paced(size_t budget) {
+    size_t purged = 0;
+    struct main_node* current_main_node = head_main->next;
+    while (current_main_node != head_main && current_main_node->v_addr_end < rss_cursor) {
+        current_main_node = current_main_node->next;
+    }
+    size_t visited = 0;
+    size_t chain_len = 0;
+    for (struct main_node* node = head_main->next; node != head_main; node = node->next) {
+        chain_len++;
+    }
+    while (visited < chain_len && purged < budget) {
+        if (current_main_node == head_main) {
+            current_main_node = head_main->next;
+        }
+        struct main_node* next = current_main_node->next;
+        struct sub_node* sub_head = current_main_node->sub_head;
+        if (current_main_node->flags & MAIN_LOCKED) {
+            // Buffer pools stay resident
+        } else if (sub_head->type == HOLE && sub_head->next == NULL && (sub_head->flags & SUB_PURGED)) {
+            release_main_node(current_main_node);
+            mems_epoch++;
+        } else {
+            for (struct sub_node* sub = sub_head; sub != NULL && purged < budget; sub = sub->next) {
+                if (sub->type == HOLE && !(sub->flags & SUB_PURGED)) {
+                    purged += purge_hole(sub);
+                }
+            }
+        }
+        rss_cursor = next != head_main ? next->v_addr_start : NULL;
+        current_main_node = next;
+        visited++;
+    }
+    return purged;
+}
+
+/*
+ * One pacing step, run from mems_free() every opt.rss_interval frees while
+ * opt.rss_target is set. The footprint is measured when idle and estimated
+ * from the purged bytes while purging, so mincore only runs again once the
+ * estimate says the low watermark was reached.
+ */
+void rss_pace() {
+    frees_since_rss_step = 0;
+    if (!rss_purging) {
+        rss_resident = measure_resident();
+        if (rss_resident <= mems_opt_rss_target) {
+            return;
+        }
+        rss_purging = 1;
+    }
+
+    size_t purged = purge_holes_paced(mems_opt_rss_step);
+    rss_steps++;
+    rss_purged += purged;
+    rss_resident -= purged < rss_resident ? purged : rss_resident;
+    if (purged < mems_opt_rss_step || rss_resident < RSS_LOW_WATERMARK(mems_opt_rss_target)) {
+        // Out of holes to purge, or the estimate says we are done: check for real
+        rss_resident = measure_resident();
+        if (purged < mems_opt_rss_step || rss_resident < RSS_LOW_WATERMARK(mems_opt_rss_target)) {
+            rss_purging = 0;
+        }
+    }
+}
+
+/*
+ * Sets a soft target for the resident memory of the MeMS heap. MeMS does
+ * not fail allocations above it; instead frees pace the purging of holes
+ * and the release of idle mappings to bring the footprint back near the
+ * target. Equivalent to writing "opt.rss_target" with mems_ctl().
+ * @param bytes The target in bytes, or 0 to disable pacing.
+ */
+void mems_set_rss_target(size_t bytes) {
+    pthread_mutex_lock(&mems_lock);
+    mems_opt_rss_target = bytes;
+    rss_purging = 0;
+    frees_since_rss_step = 0;
+    pthread_mutex_unlock(&mems_lock);
+}
+
+/*
+* Allocation profiles. A profile records what a run needed: its request
+* size distribution, the peak number of mapped pages and the slabs each
+* thread cache class used. Loading it at startup maps and faults in that
+* memory up front and fills the thread cache depot, so the first minutes
+* of the next run do not pay for heap growth one mmap at a time.
+*/
+#define PROFILE_MAGIC 0x464f5250534d654dull // "MeMSPROF"
+#define PROFILE_VERSION 1
+
+struct mems_profile {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t peak_pages;
+    uint64_t size_histogram[SIZE_BUCKETS];
+    uint64_t tcache_class_slabs[TCACHE_CLASSES];
+};
+
+// Starts a new profile; mems_init() calls it so each run is profiled on its own
+void profile_reset() {
+    memset(malloc_size_histogram, 0, sizeof(malloc_size_histogram));
+    memset(tcache_class_slabs, 0, sizeof(tcache_class_slabs));
+    peak_pages = mapped_pages;
+}
+
+/*
+ * Writes the allocation profile of the current run. The file is replaced
+ * atomically, so a crash while saving keeps the previous profile.
+ * @param path The profile file.
+ * @return 0 on success, -1 on failure.
+ */
+int mems_profile_save(const char* path) {
+    struct mems_profile profile;
+    memset(&profile, 0, sizeof(profile));
+    profile.magic = PROFILE_MAGIC;
+    profile.version = PROFILE_VERSION;
+    profile.page_size = PAGE_SIZE;
+    pthread_mutex_lock(&mems_lock);
+    profile.peak_pages = peak_pages;
+    for (int i = 0; i < SIZE_BUCKETS; i++) {
+        profile.size_histogram[i] = malloc_size_histogram[i];
+    }
+    for (int i = 0; i < TCACHE_CLASSES; i++) {
+        profile.tcache_class_slabs[i] = tcache_class_slabs[i];
+    }
+    pthread_mutex_unlock(&mems_lock);
+
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        return -1;
+    }
+    FILE* f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        perror("fopen failed on mems_profile_save");
+        return -1;
+    }
+    int ok = fwrite(&profile, sizeof(profile), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        perror("writing failed on mems_profile_save");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Warms the heap up from a saved profile: the peak page count is mapped
+ * with MAP_POPULATE as holes, the split threshold is derived from the size
+ * distribution unless it was configured, and the thread cache depot is
+ * filled with as many slabs per class as the profiled run carved.
+ * Meant to be called right after mems_init(), which does so for
+ * MEMS_PROFILE.
+ * @param path The profile file.
+ * @return 0 on success, -1 if the profile is missing, invalid or could not
+ *         be applied.
+ */
+int mems_profile_load(const char* path) {
+    struct mems_profile profile;
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        perror("fopen failed on mems_profile_load");
+        return -1;
+    }
+    int ok = fread(&profile, sizeof(profile), 1, f) == 1;
+    fclose(f);
+    if (!ok || profile.magic != PROFILE_MAGIC || profile.version != PROFILE_VERSION ||
+        profile.page_size != PAGE_SIZE) {
+        fprintf(stderr, "MeMS: ignoring invalid profile \"%s\"\n", path);
+        return -1;
+    }
+
+    size_t total = 0;
+    size_t histogram[SIZE_BUCKETS];
+    for (int i = 0; i < SIZE_BUCKETS; i++) {
+        histogram[i] = profile.size_histogram[i];
+        total += histogram[i];
+    }
+
+    pthread_mutex_lock(&mems_lock);
+    size_t split = split_threshold_for(histogram, total);
+    if (split != 0 && mems_opt_split_threshold == sizeof(struct sub_node)) {
+        mems_opt_split_threshold = split;
+    }
+    size_t pages = profile.peak_pages > mapped_pages ? profile.peak_pages - mapped_pages : 0;
+    while (pages > 0) {
+        size_t chunk = pages < (size_t)INT32_MAX / PAGE_SIZE ? pages : (size_t)INT32_MAX / PAGE_SIZE;
+        struct main_node* node = map_main_node((int)chunk, MAP_POPULATE);
+        if (node == NULL) {
+            pthread_mutex_unlock(&mems_lock);
+            return -1;
+        }
+        struct sub_node* hole = add_sub_node();
+        hole->type = HOLE;
+        hole->size = (int)(chunk * PAGE_SIZE);
+        hole->p_addr = node->p_addr;
+        hole->v_addr_start = node->v_addr_start;
+        hole->v_addr_end = node->v_addr_end;
+        hole->next = NULL;
+        hole->prev = NULL;
+        node->sub_head = hole;
+        pages -= chunk;
+    }
+    pthread_mutex_unlock(&mems_lock);
+
+    for (int cls = 0; cls < TCACHE_CLASSES; cls++) {
+        for (uint64_t i = 0; i < profile.tcache_class_slabs[cls]; i++) {
+            struct tcache_bin slab = {NULL, 0};
+            if (tcache_carve_slab(&slab, cls) != 0) {
+                return -1;
+            }
+            pthread_mutex_lock(&tcache_depot_lock);
+            tcache_move(&slab, depot_bin(cls), slab.count);
+            pthread_mutex_unlock(&tcache_depot_lock);
+        }
+    }
+    return 0;
+}
+
+/*
+* Incremental checkpoints. A checkpoint is a record appended to a file
+* descriptor: the list of live main_nodes, the descriptors (mapping size
+* and segment list) of main_nodes that changed since the previous
+* checkpoint, and the pages of PROCESS segments written since then.
+* Written pages are found through the kernel's soft-dirty bits in
+* /proc/self/pagemap; where those are unavailable every checkpoint holds
+* all pages. Replaying a full checkpoint followed by the incremental ones
+* with mems_restore() rebuilds the heap at the same virtual addresses.
+* Writers must be quiescent while a checkpoint is taken.
+*/
+#define MEMS_CHECKPOINT_FULL 1 // Write every descriptor and page
+#define CHECKPOINT_MAGIC 0x544b43534d654dull // "MeMSCKT"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_TAGGED 2
+#define PAGEMAP_SOFT_DIRTY (1ull << 55)
+
+struct checkpoint_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;        // MEMS_CHECKPOINT_FULL, CHECKPOINT_TAGGED
+    uint64_t sequence;
+    uint64_t nodes;        // Live main_nodes, each listed by its virtual start address
+    uint64_t descriptors;  // Changed main_nodes described after the list
+};
+
+struct checkpoint_node {
+    uint64_t v_addr_start;
+    uint32_t num_of_pages;
+    uint32_t flags;
+    uint64_t segments;     // checkpoint_segment records that follow
+};
+
+struct checkpoint_segment {
+    uint32_t type;
+    uint32_t size;
+};
+
+// Followed by PAGE_SIZE bytes of data; a record with v_addr 0 ends the checkpoint
+struct checkpoint_page {
+    uint64_t v_addr;
+};
+
+uint64_t checkpoint_sequence = 0;
+int soft_dirty_support = -1; // -1 until probed
+
+int write_all(int fd, const void* buf, size_t len) {
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int read_all(int fd, void* buf, size_t len) {
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Clears the soft-dirty bits of every page of the process
+int clear_soft_dirty() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int ret = write(fd, "4", 1) == 1 ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+uint64_t pagemap_entry(int pagemap, const void* addr) {
+    uint64_t entry = 0;
+    if (pread(pagemap, &entry, sizeof(entry), (off_t)((uintptr_t)addr / PAGE_SIZE * sizeof(entry))) != sizeof(entry)) {
+        return 0;
+    }
+    return entry;
+}
+
+/*
+ * Checks that soft-dirty tracking works: a page written after the bits
+ * were cleared must show up as dirty. Kernels built without it accept
+ * clear_refs but never set the bit.
+ */
+int probe_soft_dirty() {
+    int pagemap = open("/proc/self/pagemap", O_RDONLY);
+    char* page = (char*)mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int supported = 0;
+    if (pagemap != -1 && page != MAP_FAILED) {
+        *(volatile char*)page = 1;
+        if (clear_soft_dirty() == 0 && !(pagemap_entry(pagemap, page) & PAGEMAP_SOFT_DIRTY)) {
+            *(volatile char*)page = 2;
+            supported = (pagemap_entry(pagemap, page) & PAGEMAP_SOFT_DIRTY) != 0;
+        }
+    }
+    if (page != MAP_FAILED) {
+        munmap(page, PAGE_SIZE);
+    }
+    if (pagemap != -1) {
+        close(pagemap);
+    }
+    return supported;
+}
+
+// FNV-1a over a main_node's size and segment list, never 0
+unsigned int descriptor_hash(struct main_node* node) {
+    uint32_t hash = 2166136261u;
+    uint32_t words[3] = {(uint32_t)node->num_of_pages, (uint32_t)node->flags, 0};
+    for (int i = 0; i < 2; i++) {
+        hash = (hash ^ words[i]) * 16777619u;
+    }
+    for (struct sub_node* sub = node->sub_head; sub != NULL; sub = sub->next) {
+        words[0] = (uint32_t)sub->type;
+        words[1] = (uint32_t)sub->size;
+        for (int i = 0; i < 2; i++) {
+            hash = (hash ^ words[i]) * 16777619u;
+        }
+    }
+    return hash != 0 ? hash : 1;
+}
+
+int write_descriptor(int fd, struct main_node* node) {
+    struct checkpoint_node record = {(uint64_t)(uintptr_t)node->v_addr_start, (uint32_t)node->num_of_pages,
+                                     (uint32_t)node->flags, 0};
+    for (struct sub_node* sub = node->sub_head; sub != NULL; sub = sub->next) {
+        record.segments++;
+    }
+    if (write_all(fd, &record, sizeof(record)) != 0) {
+        return -1;
+    }
+    for (struct sub_node* sub = node->sub_head; sub != NULL; sub = sub->next) {
+        struct checkpoint_segment segment = {(uint32_t)sub->type, (uint32_t)sub->size};
+        if (write_all(fd, &segment, sizeof(segment)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes the pages of a main_node that overlap PROCESS segments and are
+ * set in dirty (one bit per page, NULL for all pages).
+ * @return The number of pages written, or -1 on failure.
+ */
+ssize_t write_node_pages(int fd, struct main_node* node, const unsigned char* dirty) {
+    ssize_t written = 0;
+    size_t next_page = 0; // Pages below this one were already considered
+    for (struct sub_node* sub = node->sub_head; sub != NULL; sub = sub->next) {
+        if (sub->type != PROCESS) {
+            continue;
+        }
+        size_t offset = (char*)sub->p_addr - (char*)node->p_addr;
+        size_t first = offset / PAGE_SIZE;
+        size_t last = (offset + sub->size - 1) / PAGE_SIZE;
+        for (size_t page = first > next_page ? first : next_page; page <= last; page++) {
+            if (dirty != NULL && !(dirty[page / 8] & (1 << (page % 8)))) {
+                continue;
+            }
+            struct checkpoint_page record = {(uint64_t)(uintptr_t)node->v_addr_start + page * PAGE_SIZE};
+            if (write_all(fd, &record, sizeof(record)) != 0 ||
+                write_all(fd, (char*)node->p_addr + page * PAGE_SIZE, PAGE_SIZE) != 0) {
+                return -1;
+            }
+            written++;
+        }
+        next_page = last + 1;
+    }
+    return written;
+}
+
+/*
+ * Appends a checkpoint of the heap to fd. The first checkpoint, and every
+ * checkpoint when soft-dirty tracking is unavailable, is full; later ones
+ * only hold what changed since the previous call.
+ * @param fd A file descriptor open for writing.
+ * @param flags MEMS_CHECKPOINT_FULL to force a full checkpoint, e.g. when
+ *              starting a new file.
+ * @return The number of data pages written, or -1 on failure.
+ */
+ssize_t mems_checkpoint(int fd, int flags) {
+    pthread_mutex_lock(&mems_lock);
+    if (soft_dirty_support == -1) {
+        soft_dirty_support = probe_soft_dirty();
+    }
+    int full = (flags & MEMS_CHECKPOINT_FULL) || checkpoint_sequence == 0 || !soft_dirty_support;
+
+    // Snapshot the soft-dirty bits, then clear them before copying, so
+    // pages written while the checkpoint is being taken show up next time
+    size_t bitmap_bytes = 0;
+    for (struct main_node* node = head_main->next; node != head_main; node = node->next) {
+        bitmap_bytes += ((size_t)node->num_of_pages + 7) / 8;
+    }
+    unsigned char* bitmap = NULL;
+    if (soft_dirty_support && bitmap_bytes != 0) {
+        bitmap = (unsigned char*)mmap(NULL, bitmap_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        int pagemap = open("/proc/self/pagemap", O_RDONLY);
+        if (bitmap == MAP_FAILED || pagemap == -1) {
+            perror("mmap failed on mems_checkpoint");
+            if (pagemap != -1) {
+                close(pagemap);
+            }
+            bitmap = bitmap == MAP_FAILED ? NULL : bitmap;
+            full = 1;
+        } else {
+            unsigned char* bits = bitmap;
+            for (struct main_node* node = head_main->next; node != head_main; node = node->next) {
+                uint64_t entries[512];
+                for (size_t first = 0; first < (size_t)node->num_of_pages; first += 512) {
+                    size_t count = node->num_of_pages - first < 512 ? node->num_of_pages - first : 512;
+                    off_t offset = (off_t)(((uintptr_t)node->p_addr / PAGE_SIZE + first) * sizeof(uint64_t));
+                    if (pread(pagemap, entries, count * sizeof(uint64_t), offset) != (ssize_t)(count * sizeof(uint64_t))) {
+                        memset(entries, 0xff, sizeof(entries)); // Unknown, treat as dirty
+                    }
+                    for (size_t i = 0; i < count; i++) {
+                        if (entries[i] & PAGEMAP_SOFT_DIRTY) {
+                            bits[(first + i) / 8] |= 1 << ((first + i) % 8);
+                        }
+                    }
+                }
+                bits += ((size_t)node->num_of_pages + 7) / 8;
+            }
+            close(pagemap);
+            clear_soft_dirty();
+        }
+    }
+
+    struct checkpoint_header header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, 0, ++checkpoint_sequence, 0, 0};
+    header.flags = (full ? MEMS_CHECKPOINT_FULL : 0) | (mems_opt_tagged_vaddr ? CHECKPOINT_TAGGED : 0);
+    for (struct main_node* node = head_main->next; node != head_main; node = node->next) {
+        header.nodes++;
+        if (full || node->checkpoint_hash != descriptor_hash(node)) {
+            header.descriptors++;
+        }
+    }
+
+    ssize_t pages = 0;
+    int ok = write_all(fd, &header, sizeof(header)) == 0;
+    for (struct main_node* node = head_main->next; ok && node != head_main; node = node->next) {
+        uint64_t v_addr_start = (uint64_t)(uintptr_t)node->v_addr_start;
+        ok = write_all(fd, &v_addr_start, sizeof(v_addr_start)) == 0;
+    }
+    for (struct main_node* node = head_main->next; ok && node != head_main; node = node->next) {
+        unsigned int hash = descriptor_hash(node);
+        if (full || node->checkpoint_hash != hash) {
+            ok = write_descriptor(fd, node) == 0;
+            node->checkpoint_hash = hash;
+        }
+    }
+    unsigned char* bits = bitmap;
+    for (struct main_node* node = head_main->next; ok && node != head_main; node = node->next) {
+        ssize_t written = write_node_pages(fd, node, full ? NULL : bits);
+        ok = written != -1;
+        pages += ok ? written : 0;
+        bits = bits != NULL ? bits + ((size_t)node->num_of_pages + 7) / 8 : NULL;
+    }
+    struct checkpoint_page end = {0};
+    ok = ok && write_all(fd, &end, sizeof(end)) == 0;
+
+    if (bitmap != NULL) {
+        munmap(bitmap, bitmap_bytes);
+    }
+    if (!ok) {
+        // The next checkpoint cannot be relative to a broken one
+        checkpoint_sequence = 0;
+        perror("write failed on mems_checkpoint");
+    }
+    pthread_mutex_unlock(&mems_lock);
+    return ok ? pages : -1;
+}
+
+/*
+ * Creates or resizes the main_node starting at v_addr_start for
+ * mems_restore(), keeping the main chain sorted by address.
+ * @return The main_node, or NULL if mapping failed.
+ */
+struct main_node* restore_main_node(uint64_t v_addr_start, size_t num_of_pages) {
+    struct main_node* next = head_main->next;
+    while (next != head_main && (uintptr_t)next->v_addr_start < v_addr_start) {
+        next = next->next;
+    }
+    if (next != head_main && (uintptr_t)next->v_addr_start == v_addr_start) {
+        size_t old_pages = next->num_of_pages;
+        if (old_pages != num_of_pages) {
+            void* p_addr = mremap(next->p_addr, old_pages * PAGE_SIZE, num_of_pages * PAGE_SIZE, MREMAP_MAYMOVE);
+            if (p_addr == MAP_FAILED) {
+                perror("mremap failed on mems_restore");
+                return NULL;
+            }
+            next->p_addr = p_addr;
+            next->num_of_pages = (int)num_of_pages;
+            next->v_addr_end = (char*)next->v_addr_start + num_of_pages * PAGE_SIZE - 1;
+            mapped_pages += num_of_pages - old_pages;
+        }
+        return next;
+    }
+
+    size_t slot = (v_addr_start >> TAG_SHIFT) - 1;
+    if (mems_opt_tagged_vaddr && reserve_main_slots(slot + 1) != 0) {
+        return NULL;
+    }
+    void* p_addr = mmap(NULL, num_of_pages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p_addr == MAP_FAILED) {
+        perror("mmap failed on mems_restore");
+        return NULL;
+    }
+    struct main_node* node = add_main_node();
+    node->num_of_pages = (int)num_of_pages;
+    node->p_addr = p_addr;
+    node->v_addr_start = (void*)(uintptr_t)v_addr_start;
+    node->v_addr_end = (char*)node->v_addr_start + num_of_pages * PAGE_SIZE - 1;
+    node->sub_head = NULL;
+    node->flags = 0;
+    node->checkpoint_hash = 0;
+    node->next = next;
+    node->prev = next->prev;
+    next->prev->next = node;
+    next->prev = node;
+    if (mems_opt_tagged_vaddr) {
+        while (main_slots_len <= slot) {
+            main_slots[main_slots_len++] = NULL;
+        }
+        main_slots[slot] = node;
+    }
+    mapped_pages += num_of_pages;
+    if (mapped_pages > peak_pages) {
+        peak_pages = mapped_pages;
+    }
+    return node;
+}
+
+// Reads one descriptor and rebuilds the main_node it describes
+int restore_descriptor(int fd) {
+    struct checkpoint_node record;
+    if (read_all(fd, &record, sizeof(record)) != 0 || record.num_of_pages == 0 ||
+        (uint64_t)record.num_of_pages * PAGE_SIZE > INT32_MAX) {
+        return -1;
+    }
+    struct main_node* node = restore_main_node(record.v_addr_start, record.num_of_pages);
+    if (node == NULL) {
+        return -1;
+    }
+    struct sub_node* current_sub_node = node->sub_head;
+    while (current_sub_node != NULL) {
+        struct sub_node* next = current_sub_node->next;
+        release_sub_node(current_sub_node);
+        current_sub_node = next;
+    }
+    node->sub_head = NULL;
+
+    size_t offset = 0;
+    struct sub_node* last = NULL;
+    for (uint64_t i = 0; i < record.segments; i++) {
+        struct checkpoint_segment segment;
+        if (read_all(fd, &segment, sizeof(segment)) != 0 || segment.size == 0 ||
+            offset + segment.size > (size_t)node->num_of_pages * PAGE_SIZE) {
+            return -1;
+        }
+        struct sub_node* sub = add_sub_node();
+        sub->type = segment.type == PROCESS || segment.type == PAD ? (int)segment.type : HOLE;
+        sub->size = (int)segment.size;
+        sub->p_addr = (char*)node->p_addr + offset;
+        sub->v_addr_start = (char*)node->v_addr_start + offset;
+        sub->v_addr_end = (char*)sub->v_addr_start + segment.size - 1;
+        sub->next = NULL;
+        sub->prev = last;
+        if (last != NULL) {
+            last->next = sub;
+        } else {
+            node->sub_head = sub;
+        }
+        last = sub;
+        offset += segment.size;
+    }
+    // Buffer pools are not part of a checkpoint, their memory comes back as ordinary segments
+    node->flags = (int)record.flags & ~MAIN_LOCKED;
+    return offset == (size_t)node->num_of_pages * PAGE_SIZE ? 0 : -1;
+}
+
+/*
+ * Rebuilds the heap from the checkpoints in fd: a full checkpoint followed
+ * by any number of incremental ones, as written by mems_checkpoint(). Every
+ * segment gets back its MeMS virtual address and contents. The heap must be
+ * empty and opt.tagged_vaddr must match the checkpointed process.
+ * @param fd A file descriptor positioned at the first checkpoint.
+ * @return The number of checkpoints applied, or -1 on failure.
+ */
+ssize_t mems_restore(int fd) {
+    pthread_mutex_lock(&mems_lock);
+    if (head_main->next != head_main) {
+        fprintf(stderr, "MeMS: mems_restore needs an empty heap\n");
+        pthread_mutex_unlock(&mems_lock);
+        return -1;
+    }
+
+    ssize_t applied = 0;
+    int ok = 1;
+    for (;;) {
+        struct checkpoint_header header;
+        ssize_t n = read(fd, &header, sizeof(header));
+        if (n == 0) {
+            break;
+        }
+        if (n != sizeof(header) || header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION ||
+            (applied == 0 && !(header.flags & MEMS_CHECKPOINT_FULL)) ||
+            !(header.flags & CHECKPOINT_TAGGED) != !mems_opt_tagged_vaddr) {
+            fprintf(stderr, "MeMS: mems_restore found an invalid or mismatched checkpoint\n");
+            ok = 0;
+            break;
+        }
+
+        // Drop the main_nodes that no longer exist; the list is in address order
+        struct main_node* node = head_main->next;
+        for (uint64_t i = 0; ok && i < header.nodes; i++) {
+            uint64_t v_addr_start;
+            ok = read_all(fd, &v_addr_start, sizeof(v_addr_start)) == 0;
+            while (ok && node != head_main && (uintptr_t)node->v_addr_start < v_addr_start) {
+                struct main_node* next = node->next;
+                release_main_node(node);
+                node = next;
+            }
+            if (ok && node != head_main && (uintptr_t)node->v_addr_start == v_addr_start) {
+                node = node->next;
+            }
+        }
+        while (ok && node != head_main) {
+            struct main_node* next = node->next;
+            release_main_node(node);
+            node = next;
+        }
+
+        for (uint64_t i = 0; ok && i < header.descriptors; i++) {
+            ok = restore_descriptor(fd) == 0;
+        }
+
+        struct checkpoint_page record;
+        while (ok && (ok = read_all(fd, &record, sizeof(record)) == 0) && record.v_addr != 0) {
+            struct main_node* owner = find_main_node((void*)(uintptr_t)record.v_addr);
+            ok = owner != NULL && (char*)owner->v_addr_end - (char*)(uintptr_t)record.v_addr + 1 >= PAGE_SIZE &&
+                 read_all(fd, (char*)owner->p_addr + ((char*)(uintptr_t)record.v_addr - (char*)owner->v_addr_start),
+                          PAGE_SIZE) == 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "MeMS: mems_restore found a truncated or corrupt checkpoint\n");
+            break;
+        }
+        applied++;
+    }
+    mems_epoch++;
+    __atomic_add_fetch(&tcache_generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mems_lock);
+    return ok ? applied : -1;
+}
+
+#endif // MEMS_H
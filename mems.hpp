@@ -0,0 +1,538 @@
+/*
+* mems.hpp
+*
+* C++ helpers on top of MeMS. mems::vptr<T> wraps a MeMS virtual address
+* and translates it on dereference, caching the bounds of the segment it
+* points into so repeated accesses skip mems_get(). mems::vector<T> is a
+* growable array whose segment is extended in place whenever possible.
+* mems::region<Buffers...> lays out a fixed set of buffers at compile time
+* and maps them with a single MeMS mapping.
+* With C++20 coroutines, mems::task<T> allocates its frames from the MeMS
+* thread cache.
+*/
+
+#ifndef MEMS_HPP
+#define MEMS_HPP
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpointer-arith"
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#include "mems.h"
+#pragma GCC diagnostic pop
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <optional>
+#define MEMS_HAS_COROUTINES 1
+#endif
+
+namespace mems {
+
+/*
+ * A typed MeMS virtual pointer. It behaves like T* for arithmetic,
+ * comparison and indexing, while dereferencing translates the virtual
+ * address to physical memory. The segment found by the last translation is
+ * cached together with mems_epoch, so accesses inside the same segment cost
+ * a bounds check until MeMS frees, resets or moves memory.
+ * Dereferencing an address outside any allocated segment throws
+ * std::out_of_range.
+ */
+template <typename T>
+class vptr {
+public:
+    vptr() = default;
+    vptr(std::nullptr_t) {}
+    explicit vptr(void* v_addr) : addr_(reinterpret_cast<std::uintptr_t>(v_addr)) {}
+
+    // The MeMS virtual address, suitable for mems_free() and friends
+    void* v_addr() const { return reinterpret_cast<void*>(addr_); }
+
+    // The physical address of the pointee, valid until mems_epoch changes
+    T* get() const { return translate(addr_); }
+
+    T& operator*() const { return *translate(addr_); }
+    T* operator->() const { return translate(addr_); }
+    T& operator[](std::ptrdiff_t index) const { return *translate(addr_ + index * sizeof(T)); }
+
+    vptr& operator+=(std::ptrdiff_t n) { addr_ += n * sizeof(T); return *this; }
+    vptr& operator-=(std::ptrdiff_t n) { addr_ -= n * sizeof(T); return *this; }
+    vptr& operator++() { addr_ += sizeof(T); return *this; }
+    vptr& operator--() { addr_ -= sizeof(T); return *this; }
+    vptr operator++(int) { vptr old = *this; addr_ += sizeof(T); return old; }
+    vptr operator--(int) { vptr old = *this; addr_ -= sizeof(T); return old; }
+    friend vptr operator+(vptr p, std::ptrdiff_t n) { return p += n; }
+    friend vptr operator+(std::ptrdiff_t n, vptr p) { return p += n; }
+    friend vptr operator-(vptr p, std::ptrdiff_t n) { return p -= n; }
+    friend std::ptrdiff_t operator-(const vptr& a, const vptr& b) {
+        return (static_cast<std::ptrdiff_t>(a.addr_) - static_cast<std::ptrdiff_t>(b.addr_)) / static_cast<std::ptrdiff_t>(sizeof(T));
+    }
+
+    friend bool operator==(const vptr& a, const vptr& b) { return a.addr_ == b.addr_; }
+    friend bool operator!=(const vptr& a, const vptr& b) { return a.addr_ != b.addr_; }
+    friend bool operator<(const vptr& a, const vptr& b) { return a.addr_ < b.addr_; }
+    friend bool operator<=(const vptr& a, const vptr& b) { return a.addr_ <= b.addr_; }
+    friend bool operator>(const vptr& a, const vptr& b) { return a.addr_ > b.addr_; }
+    friend bool operator>=(const vptr& a, const vptr& b) { return a.addr_ >= b.addr_; }
+    explicit operator bool() const { return addr_ != 0; }
+
+private:
+    T* translate(std::uintptr_t addr) const {
+        if (cache_epoch_ != mems_epoch || addr < cache_start_ || addr + sizeof(T) - 1 > cache_end_) {
+            refill(addr);
+        }
+        return reinterpret_cast<T*>(cache_p_addr_ + (addr - cache_start_));
+    }
+
+    void refill(std::uintptr_t addr) const {
+        struct mems_segment segment;
+        if (mems_get_segment(reinterpret_cast<void*>(addr), &segment) != 0 ||
+            addr + sizeof(T) - 1 > reinterpret_cast<std::uintptr_t>(segment.v_addr_end)) {
+            throw std::out_of_range("mems::vptr: address is not inside an allocated segment");
+        }
+        cache_start_ = reinterpret_cast<std::uintptr_t>(segment.v_addr_start);
+        cache_end_ = reinterpret_cast<std::uintptr_t>(segment.v_addr_end);
+        cache_p_addr_ = reinterpret_cast<std::uintptr_t>(segment.p_addr);
+        cache_epoch_ = mems_epoch;
+    }
+
+    std::uintptr_t addr_ = 0;
+    // Translation cache: virtual bounds and physical start of the last segment
+    mutable std::uintptr_t cache_start_ = 1;
+    mutable std::uintptr_t cache_end_ = 0;
+    mutable std::uintptr_t cache_p_addr_ = 0;
+    mutable std::uint64_t cache_epoch_ = 0;
+};
+
+// Allocates room for count objects of type T. Throws std::bad_alloc on failure.
+template <typename T>
+vptr<T> allocate(std::size_t count = 1) {
+    void* v_addr = mems_malloc(count * sizeof(T));
+    if (v_addr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return vptr<T>(v_addr);
+}
+
+template <typename T>
+void deallocate(vptr<T> p) {
+    mems_free(p.v_addr());
+}
+
+/*
+ * A growable array stored in a single MeMS segment. Growth first tries
+ * mems_extend(), which takes space from a following hole or remaps large
+ * buffers, so the contents are only copied when neither is possible. While
+ * growth happens in place, v_addr() stays the same. Elements are relocated
+ * bitwise, hence T must be trivially copyable.
+ */
+template <typename T>
+class vector {
+    static_assert(std::is_trivially_copyable<T>::value, "mems::vector relocates elements with memcpy");
+
+public:
+    vector() = default;
+    explicit vector(std::size_t count, const T& value = T()) { resize(count, value); }
+    vector(const vector&) = delete;
+    vector& operator=(const vector&) = delete;
+    vector(vector&& other) noexcept { swap(other); }
+    vector& operator=(vector&& other) noexcept {
+        swap(other);
+        return *this;
+    }
+    ~vector() {
+        if (data_) {
+            mems_free(data_.v_addr());
+        }
+    }
+
+    T& operator[](std::size_t index) { return data_[index]; }
+    const T& operator[](std::size_t index) const { return data_[index]; }
+    T& at(std::size_t index) {
+        if (index >= size_) {
+            throw std::out_of_range("mems::vector::at");
+        }
+        return data_[index];
+    }
+    T& front() { return data_[0]; }
+    T& back() { return data_[size_ - 1]; }
+
+    vptr<T> begin() const { return data_; }
+    vptr<T> end() const { return data_ + size_; }
+    vptr<T> data() const { return data_; }
+    // The MeMS virtual address of the storage, unchanged by in-place growth
+    void* v_addr() const { return data_.v_addr(); }
+
+    std::size_t size() const { return size_; }
+    std::size_t capacity() const { return capacity_; }
+    bool empty() const { return size_ == 0; }
+
+    void reserve(std::size_t count) {
+        if (count <= capacity_) {
+            return;
+        }
+        void* v_addr = mems_realloc(data_.v_addr(), count * sizeof(T));
+        if (v_addr == nullptr) {
+            throw std::bad_alloc();
+        }
+        // The segment may be larger than requested if a small hole was absorbed
+        struct mems_segment segment;
+        mems_get_segment(v_addr, &segment);
+        data_ = vptr<T>(v_addr);
+        capacity_ = (static_cast<char*>(segment.v_addr_end) - static_cast<char*>(segment.v_addr_start) + 1) / sizeof(T);
+    }
+
+    void resize(std::size_t count, const T& value = T()) {
+        reserve(count);
+        for (std::size_t i = size_; i < count; i++) {
+            data_[i] = value;
+        }
+        size_ = count;
+    }
+
+    void push_back(const T& value) {
+        if (size_ == capacity_) {
+            reserve(capacity_ < 8 ? 8 : capacity_ * 2);
+        }
+        data_[size_++] = value;
+    }
+
+    template <typename... Args>
+    T& emplace_back(Args&&... args) {
+        push_back(T(std::forward<Args>(args)...));
+        return back();
+    }
+
+    void pop_back() { size_--; }
+    void clear() { size_ = 0; }
+
+    void swap(vector& other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+    }
+
+private:
+    vptr<T> data_;
+    std::size_t size_ = 0;
+    std::size_t capacity_ = 0;
+};
+
+/*
+ * Declares one buffer of a static allocation set: count objects of type T
+ * aligned to align bytes. Deriving a named struct from it, as in
+ * struct rx_ring : mems::buffer<char, 65536, 64> {};, lets region::get()
+ * find the buffer by that name.
+ */
+template <typename T, std::size_t Count = 1, std::size_t Align = alignof(T)>
+struct buffer {
+    static_assert(Count > 0, "mems::buffer needs at least one element");
+    static_assert(Align >= alignof(T) && (Align & (Align - 1)) == 0,
+                  "mems::buffer alignment must be a power of two no weaker than alignof(T)");
+    static_assert(Align <= PAGE_SIZE, "mems::buffer alignment cannot exceed PAGE_SIZE");
+    static_assert(std::is_trivially_default_constructible<T>::value && std::is_trivially_destructible<T>::value,
+                  "mems::buffer elements live in zero-filled memory and are never constructed or destroyed");
+
+    using element_type = T;
+    static constexpr std::size_t count = Count;
+    static constexpr std::size_t align = Align;
+    static constexpr std::size_t bytes = sizeof(T) * Count;
+};
+
+namespace detail {
+
+template <std::size_t N>
+struct layout_plan {
+    std::size_t offsets[N];
+    std::size_t size;
+};
+
+/*
+ * Places buffers in order of decreasing alignment, each at the next offset
+ * satisfying its alignment, so padding is only needed where a buffer's size
+ * is not a multiple of the next buffer's alignment.
+ */
+template <std::size_t N>
+constexpr layout_plan<N> plan_layout(const std::size_t (&bytes)[N], const std::size_t (&aligns)[N]) {
+    layout_plan<N> plan{};
+    std::size_t order[N] = {};
+    for (std::size_t i = 0; i < N; i++) {
+        std::size_t j = i;
+        while (j > 0 && aligns[order[j - 1]] < aligns[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    std::size_t offset = 0;
+    for (std::size_t i = 0; i < N; i++) {
+        std::size_t index = order[i];
+        offset = (offset + aligns[index] - 1) / aligns[index] * aligns[index];
+        plan.offsets[index] = offset;
+        offset += bytes[index];
+    }
+    plan.size = offset;
+    return plan;
+}
+
+// The position of Buffer in Buffers, or sizeof...(Buffers) if it is absent
+template <typename Buffer, typename... Buffers>
+struct buffer_index;
+
+template <typename Buffer>
+struct buffer_index<Buffer> : std::integral_constant<std::size_t, 0> {};
+
+template <typename Buffer, typename First, typename... Rest>
+struct buffer_index<Buffer, First, Rest...>
+    : std::integral_constant<std::size_t, std::is_same<Buffer, First>::value ? 0 : 1 + buffer_index<Buffer, Rest...>::value> {};
+
+} // namespace detail
+
+/*
+ * The compile-time layout of a set of buffers inside one region: the byte
+ * offset of every buffer and the total size.
+ */
+template <typename... Buffers>
+struct layout {
+    static_assert(sizeof...(Buffers) > 0, "mems::layout needs at least one buffer");
+
+    template <std::size_t I>
+    using buffer_type = typename std::tuple_element<I, std::tuple<Buffers...>>::type;
+
+    static constexpr detail::layout_plan<sizeof...(Buffers)> plan() {
+        return detail::plan_layout<sizeof...(Buffers)>({Buffers::bytes...}, {Buffers::align...});
+    }
+
+    template <std::size_t I>
+    static constexpr std::size_t offset() { return plan().offsets[I]; }
+
+    static constexpr std::size_t size() { return plan().size; }
+    static constexpr std::size_t pages() { return (size() + PAGE_SIZE - 1) / PAGE_SIZE; }
+};
+
+/*
+ * A static allocation set. The layout of Buffers... is computed at compile
+ * time, and the constructor maps exactly the pages it needs as one MeMS
+ * mapping holding a single segment, so no hole is searched and every
+ * accessor adds a constant to the mapping's base. The memory is zero-filled
+ * and keeps its physical address until the region is destroyed, which hands
+ * the mapping back to the heap as a hole. Throws std::bad_alloc if the
+ * mapping fails.
+ */
+template <typename... Buffers>
+class region {
+public:
+    using layout_type = layout<Buffers...>;
+
+    region() {
+        static_assert(layout_type::pages() <= INT32_MAX / PAGE_SIZE, "mems::region is too large for one mapping");
+        pthread_mutex_lock(&mems_lock);
+        struct main_node* node = map_main_node(static_cast<int>(layout_type::pages()), 0);
+        if (node == nullptr) {
+            pthread_mutex_unlock(&mems_lock);
+            throw std::bad_alloc();
+        }
+        struct sub_node* segment = add_sub_node();
+        segment->type = PROCESS;
+        segment->size = static_cast<int>(layout_type::pages() * PAGE_SIZE);
+        segment->p_addr = node->p_addr;
+        segment->v_addr_start = node->v_addr_start;
+        segment->v_addr_end = node->v_addr_end;
+        segment->next = nullptr;
+        segment->prev = nullptr;
+        node->sub_head = segment;
+        pthread_mutex_unlock(&mems_lock);
+        p_addr_ = static_cast<char*>(node->p_addr);
+        v_addr_ = static_cast<char*>(node->v_addr_start);
+    }
+
+    region(const region&) = delete;
+    region& operator=(const region&) = delete;
+    region(region&& other) noexcept
+        : p_addr_(std::exchange(other.p_addr_, nullptr)), v_addr_(std::exchange(other.v_addr_, nullptr)) {}
+    region& operator=(region&& other) noexcept {
+        std::swap(p_addr_, other.p_addr_);
+        std::swap(v_addr_, other.v_addr_);
+        return *this;
+    }
+    ~region() {
+        if (v_addr_ != nullptr) {
+            mems_free(v_addr_);
+        }
+    }
+
+    // The physical address of buffer I
+    template <std::size_t I>
+    typename layout_type::template buffer_type<I>::element_type* get() const {
+        using T = typename layout_type::template buffer_type<I>::element_type;
+        return reinterpret_cast<T*>(p_addr_ + std::integral_constant<std::size_t, layout_type::template offset<I>()>::value);
+    }
+
+    // The physical address of the buffer declared as Buffer
+    template <typename Buffer>
+    typename Buffer::element_type* get() const {
+        static_assert(detail::buffer_index<Buffer, Buffers...>::value < sizeof...(Buffers),
+                      "mems::region::get: the buffer is not part of this region");
+        return get<detail::buffer_index<Buffer, Buffers...>::value>();
+    }
+
+    // The MeMS virtual address of buffer I, for the mems_* range and I/O functions
+    template <std::size_t I>
+    vptr<typename layout_type::template buffer_type<I>::element_type> v_get() const {
+        using T = typename layout_type::template buffer_type<I>::element_type;
+        return vptr<T>(v_addr_ + std::integral_constant<std::size_t, layout_type::template offset<I>()>::value);
+    }
+
+    template <typename Buffer>
+    vptr<typename Buffer::element_type> v_get() const {
+        static_assert(detail::buffer_index<Buffer, Buffers...>::value < sizeof...(Buffers),
+                      "mems::region::v_get: the buffer is not part of this region");
+        return v_get<detail::buffer_index<Buffer, Buffers...>::value>();
+    }
+
+    // The MeMS virtual address of the whole region
+    void* v_addr() const { return v_addr_; }
+
+private:
+    char* p_addr_ = nullptr;
+    char* v_addr_ = nullptr;
+};
+
+#ifdef MEMS_HAS_COROUTINES
+
+/*
+ * Base class for coroutine promise types whose frames should come from the
+ * MeMS thread cache instead of the global allocator. Frames larger than
+ * TCACHE_MAX_SIZE fall back to ::operator new.
+ */
+struct frame_allocated {
+    static void* operator new(std::size_t size) {
+        void* frame = size <= TCACHE_MAX_SIZE ? mems_tcache_alloc(size) : nullptr;
+        return frame != nullptr ? frame : ::operator new(size);
+    }
+
+    static void operator delete(void* frame, std::size_t size) {
+        if (size <= TCACHE_MAX_SIZE && reinterpret_cast<std::uintptr_t>(frame) % TCACHE_ALIGN == 0) {
+            mems_tcache_free(frame, size);
+        } else {
+            ::operator delete(frame);
+        }
+    }
+};
+
+template <typename T>
+class task;
+
+namespace detail {
+
+template <typename T>
+struct task_promise_base : frame_allocated {
+    // Resumes whoever awaited the task once it finishes
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+};
+
+template <typename T>
+struct task_promise : task_promise_base<T> {
+    task<T> get_return_object();
+    template <typename U>
+    void return_value(U&& value) { result.emplace(std::forward<U>(value)); }
+    T take() { return std::move(*result); }
+
+    std::optional<T> result;
+};
+
+template <>
+struct task_promise<void> : task_promise_base<void> {
+    task<void> get_return_object();
+    void return_void() {}
+    void take() {}
+};
+
+} // namespace detail
+
+/*
+ * A lazily started coroutine whose frame lives in the MeMS thread cache.
+ * Awaiting a task starts it and resumes the awaiter when it completes;
+ * get() runs a task to completion from non-coroutine code.
+ */
+template <typename T = void>
+class task {
+public:
+    using promise_type = detail::task_promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit task(handle_type handle) : handle_(handle) {}
+    task(task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    task& operator=(task&& other) noexcept {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+    ~task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        handle_.promise().continuation = awaiter;
+        return handle_;
+    }
+    T await_resume() { return result(); }
+
+    // Runs the task until it completes and returns its result
+    T get() {
+        if (!handle_.done()) {
+            handle_.resume();
+        }
+        return result();
+    }
+
+private:
+    T result() {
+        if (handle_.promise().error) {
+            std::rethrow_exception(handle_.promise().error);
+        }
+        return handle_.promise().take();
+    }
+
+    handle_type handle_;
+};
+
+template <typename T>
+task<T> detail::task_promise<T>::get_return_object() {
+    return task<T>(task<T>::handle_type::from_promise(*this));
+}
+
+inline task<void> detail::task_promise<void>::get_return_object() {
+    return task<void>(task<void>::handle_type::from_promise(*this));
+}
+
+#endif // MEMS_HAS_COROUTINES
+
+} // namespace mems
+
+#endif // MEMS_HPP